@@ -1,10 +1,27 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <float.h>
 #include <math.h>
+#include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/sysinfo.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <complex>
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION 1
 
@@ -12,13 +29,37 @@
 #include "scm_colormaps.h"
 #include "stb_image_write.h"
 
-uint32_t max_steps = 1 << 11;
-uint32_t min_steps = 1 << 7;
+// The iteration limits belong to the current job: with --daemon, several jobs run
+// concurrently, each on its own thread, and create_thread passes them on to the workers.
+thread_local uint32_t max_steps = 1 << 11;
+thread_local uint32_t min_steps = 1 << 7;
+
+// Render job received by the --daemon mode (see serve).
+struct DaemonJob {
+    struct DaemonClient* client;
+    char* line;  // storage of id and argv
+    char* id;
+    int argc;
+    char** argv;
+    int num_threads;
+    uint64_t number;  // arrival order, which draws the default -r of the job
+    bool started;
+    std::atomic<bool> cancelled;
+    char* output;  // image written to FILENAME "-" (see open_output)
+    size_t output_size;
+    DaemonJob* next;
+};
+
+// Job of the --daemon mode run by the current thread (NULL outside of the daemon).
+thread_local DaemonJob* daemon_job = NULL;
 
 #define COUNT(a) (sizeof(a) / sizeof(0 [a]))
 
 #define LERP(a, b, u) ((a) * (1 - (u)) + (b) * (u))
 
+// Step buffers use 16-bit samples whenever every sample (at most max_steps + 1) fits.
+#define SAMPLE16_LIMIT 65535
+
 union BufferData {
     uint32_t value;
     struct {
@@ -26,17 +67,222 @@ union BufferData {
     };
 };
 
-static inline long double rand_range(long double min, long double max) {
-    long double u = (long double)rand() / RAND_MAX;
+// Iteration count dump (options -d and -l).  The file starts with a StepsHeader and the
+// raw step buffer follows at offset header_size, which is a multiple of STEPS_ALIGNMENT, so
+// that the samples can be used directly from a memory mapping.  Samples are stored row by
+// row as 1 + the number of iterations before escape (max_steps + 1 for points that never
+// escape), using 16-bit samples when max_steps < SAMPLE16_LIMIT and 32-bit otherwise.  All
+// fields use the host byte order.  Coordinates are stored as pairs of doubles (high and low
+// parts) to keep the precision of long double in a portable form.
+//
+// Dumps saved with --resumable also keep the last z of the pixels that reached max_steps
+// without escaping: state_count StepState records follow the samples (at the next multiple
+// of STEPS_ALIGNMENT), sorted by pixel index.  Loading such a dump with a larger -z MAX
+// continues these pixels from where they stopped (see resume_samples).
+#define STEPS_MAGIC "MANDSTEP"
+#define STEPS_VERSION 1
+#define STEPS_ALIGNMENT 64
+
+struct StepsHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t width, height;
+    uint32_t sample_size;
+    uint32_t min_steps, max_steps;
+    uint32_t smin, smax;
+    uint32_t state_count;  // number of StepState records after the samples
+    uint32_t reserved[3];
+    double x[2], y[2], dx[2], dy[2];
+};
+
+struct StepState {
+    uint64_t index;     // pixel index (row by row)
+    double r[2], i[2];  // z after max_steps iterations (high and low parts)
+};
+
+static_assert(sizeof(StepsHeader) % STEPS_ALIGNMENT == 0, "unaligned step data");
+
+static inline void split_coordinate(long double value, double* parts) {
+    parts[0] = (double)value;
+    parts[1] = (double)(value - parts[0]);
+}
+
+static inline long double join_coordinate(const double* parts) {
+    return (long double)parts[0] + parts[1];
+}
+
+// Write the buffers of iov to filename straight from memory, without intermediate copies.
+static bool write_file(const char* filename, struct iovec* iov, int count) {
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error: unable to open %s for writing.\n", filename);
+        return false;
+    }
+    struct iovec* v = iov;
+    while (count > 0) {
+        ssize_t written = writev(fd, v, count);
+        if (written < 0) {
+            fprintf(stderr, "Error: failed writing to %s.\n", filename);
+            close(fd);
+            return false;
+        }
+        while (count > 0 && (size_t)written >= v->iov_len) {
+            written -= v->iov_len;
+            v++;
+            count--;
+        }
+        if (count > 0) {
+            v->iov_base = (char*)v->iov_base + written;
+            v->iov_len -= written;
+        }
+    }
+    close(fd);
+    return true;
+}
+
+static inline size_t steps_state_offset(const StepsHeader& header) {
+    const size_t end =
+        header.header_size + (size_t)header.sample_size * header.width * header.height;
+    return (end + STEPS_ALIGNMENT - 1) / STEPS_ALIGNMENT * STEPS_ALIGNMENT;
+}
+
+static bool save_steps(const char* filename, const StepsHeader& header, const void* samples,
+                       const StepState* states) {
+    static const char padding[STEPS_ALIGNMENT] = {};
+    const size_t samples_size = (size_t)header.sample_size * header.width * header.height;
+    struct iovec iov[4] = {
+        {(void*)&header, sizeof(StepsHeader)},
+        {(void*)samples, samples_size},
+        {(void*)padding, steps_state_offset(header) - header.header_size - samples_size},
+        {(void*)states, sizeof(StepState) * header.state_count}};
+    return write_file(filename, iov, header.state_count > 0 ? 4 : 2);
+}
+
+// Map a step dump created by save_steps in memory.  The mapping is private and writable, so
+// the samples can be modified in place without changing the file.  Returns the base of the
+// mapping (to be released with munmap) or NULL on error.
+static void* load_steps(const char* filename, StepsHeader& header, size_t& map_size) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: unable to open %s for reading.\n", filename);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(StepsHeader)) {
+        fprintf(stderr, "Error: %s is not a valid step dump.\n", filename);
+        close(fd);
+        return NULL;
+    }
+    map_size = st.st_size;
+    void* map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error: unable to map %s in memory.\n", filename);
+        return NULL;
+    }
+    memcpy(&header, map, sizeof(StepsHeader));
+    if (memcmp(header.magic, STEPS_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != STEPS_VERSION || header.header_size % STEPS_ALIGNMENT != 0 ||
+        header.header_size < sizeof(StepsHeader) ||
+        (header.sample_size != sizeof(uint16_t) && header.sample_size != sizeof(uint32_t)) ||
+        header.width == 0 || header.height == 0 ||
+        map_size < header.header_size +
+                       (size_t)header.sample_size * header.width * header.height ||
+        (header.state_count > 0 &&
+         map_size < steps_state_offset(header) + sizeof(StepState) * header.state_count)) {
+        fprintf(stderr, "Error: %s is not a valid step dump.\n", filename);
+        munmap(map, map_size);
+        return NULL;
+    }
+    return map;
+}
+
+// Coordinate of pixel i out of n along an axis spanning [min, max].  The offset from the
+// center is computed so that pixels i and n - 1 - i are exactly opposite, which keeps the
+// rows of windows centered on the real axis exactly symmetric (see mirror_rows).
+static inline long double pixel_coordinate(long double min, long double max, int i, int n) {
+    const long double t = (2.0L * i - (n - 1)) / (n - 1.0L);
+    return (min + max) / 2 + (max - min) / 2 * t;
+}
+
+struct ThreadStart {
+    void* (*routine)(void*);
+    void* arg;
+    uint32_t max_steps, min_steps;
+    DaemonJob* daemon_job;
+};
+
+static void* start_thread(void* p) {
+    ThreadStart start = *(ThreadStart*)p;
+    free(p);
+    max_steps = start.max_steps;
+    min_steps = start.min_steps;
+    daemon_job = start.daemon_job;
+    return start.routine(start.arg);
+}
+
+// pthread_create for the workers of the current job.
+static int create_thread(pthread_t* thread, void* (*routine)(void*), void* arg) {
+    ThreadStart* start = (ThreadStart*)malloc(sizeof(ThreadStart));
+    *start = {routine, arg, max_steps, min_steps, daemon_job};
+    const int result = pthread_create(thread, NULL, start_thread, start);
+    if (result != 0) free(start);
+    return result;
+}
+
+// Whether the current daemon job was cancelled, in which case the computation stops as soon
+// as possible and leaves the samples incomplete.
+static inline bool job_cancelled() { return daemon_job != NULL && daemon_job->cancelled; }
+
+// Open an output image; the FILENAME "-" of a daemon job is returned with its response.
+static FILE* open_output(const char* filename) {
+    if (daemon_job != NULL && strcmp(filename, "-") == 0) {
+        free(daemon_job->output);
+        daemon_job->output = NULL;
+        return open_memstream(&daemon_job->output, &daemon_job->output_size);
+    }
+    return fopen(filename, "wb");
+}
+
+static double elapsed_ms(const struct timespec& start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) * 1e3 + (now.tv_nsec - start.tv_nsec) * 1e-6;
+}
+
+// Counter-based random numbers: draw n of a stream is the SplitMix64 output for seed and n,
+// so that each job owns its random state and any draw can be computed independently of the
+// others (which keeps parallel searches reproducible).
+struct Random {
+    uint64_t seed;
+    uint64_t counter;
+};
+
+static inline uint64_t random_bits(uint64_t seed, uint64_t n) {
+    uint64_t z = seed + (n + 1) * 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+static inline long double random_unit(uint64_t seed, uint64_t n) {
+    return (long double)random_bits(seed, n) * 0x1p-64L;
+}
+
+static inline uint64_t random_next(Random& rng) { return random_bits(rng.seed, rng.counter++); }
+
+static inline long double random_range(Random& rng, long double min, long double max) {
+    const long double u = random_unit(rng.seed, rng.counter++);
     return LERP(min, max, u);
 }
 
-static uint32_t mandelbrot(long double x, long double y) {
-    long double r = x;
-    long double i = y;
+// Iterate z -> z^2 + c for c = (x, y), starting from z = (r, i) after steps iterations, until
+// |z| > 2 or limit iterations.  Returns the number of iterations, and the last z in (r, i).
+static inline uint32_t iterate(long double x, long double y, long double& r, long double& i,
+                               uint32_t steps, uint32_t limit) {
     long double mag_sq = r * r + i * i;
-    uint32_t steps = 0;
-    while (steps < max_steps && mag_sq <= 4) {
+    while (steps < limit && mag_sq <= 4) {
         long double rr = r * r - i * i + x;
         i = 2 * r * i + y;
         r = rr;
@@ -46,152 +292,3192 @@ static uint32_t mandelbrot(long double x, long double y) {
     return steps;
 }
 
-static uint32_t choose_center(long double& x, long double& y) {
+static uint32_t mandelbrot(long double x, long double y) {
+    long double r = x;
+    long double i = y;
+    return iterate(x, y, r, i, 0, max_steps);
+}
+
+// Region searched for random centers (the set is symmetric, only its upper half is used).
+#define CENTER_XMIN -1.5L
+#define CENTER_XMAX 1.0L
+#define CENTER_YMIN 0.0L
+#define CENTER_YMAX 1.0L
+
+// Interest atlas (options --build-atlas and --atlas): a precomputed sample of the center
+// region on a grid of root cells, subdivided recursively where the escape counts of their
+// quarters differ, so that the cells are small along the boundary of the set.  Each entry is
+// the center, depth and escape count of a cell.  Entries are sorted by band of escape counts
+// (floor(log2(steps))) and each band carries a Vose alias table over the cell areas, so that
+// choose_center draws a center with min_steps <= steps < max_steps from the mapped file in
+// constant time, with the same area distribution as the rejection sampler.
+#define ATLAS_MAGIC "MANDATLS"
+#define ATLAS_VERSION 1
+#define ATLAS_BANDS 32
+#define ATLAS_ROOT_CELLS 64   // root cells per unit of length
+#define ATLAS_DEPTH 4         // maximal subdivision depth of the root cells
+#define ATLAS_MAX_DRAWS 64
+
+struct AtlasHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t max_steps;
+    uint32_t count;
+    uint32_t band_start[ATLAS_BANDS + 1];  // index of the first entry of each band
+    double band_area[ATLAS_BANDS];
+    double root_size;
+};
+
+struct AtlasEntry {
+    double x, y;
     uint32_t steps;
-    do {
-        x = rand_range(-1.5, 1);
-        y = rand_range(0, 1);
-        steps = mandelbrot(x, y);
-    } while (steps < min_steps || steps >= max_steps);
-    return steps;
+    uint32_t depth;  // the cell size is root_size / 2^depth
+    uint32_t alias;  // alias table entry, relative to the band start
+    float prob;
+};
+
+static_assert(sizeof(AtlasHeader) % sizeof(double) == 0, "unaligned atlas entries");
+
+struct Atlas {
+    const AtlasHeader* header;
+    const AtlasEntry* entries;
+    size_t map_size;
+};
+
+static Atlas atlas = {};
+
+static inline int atlas_band(uint32_t steps) { return 31 - __builtin_clz(steps); }
+
+static inline bool atlas_band_in_range(int band) {
+    return ((uint64_t)1 << band) < max_steps && ((uint64_t)2 << band) > min_steps;
 }
 
-struct CalcBufferData {
+struct AtlasRow {
+    AtlasEntry* entries;
+    uint32_t count, capacity;
+};
+
+struct AtlasBuildData {
     int thread_id;
-    BufferData* buffer;
-    int start_line, last_line;
-    int width, height;
-    uint32_t smin, smax;
-    long double xmin, xmax, ymin, ymax;
+    AtlasRow* rows;
+    int num_rows, num_cols;
+    std::atomic<int>* next;
 };
 
-static void* calc_buffer(void* p) {
-    CalcBufferData* data = (CalcBufferData*)p;
-    BufferData* b = data->buffer + data->start_line * data->width;
+static void atlas_add(AtlasRow& row, long double x, long double y, uint32_t steps,
+                      uint32_t depth) {
+    if (steps == 0 || steps >= max_steps) return;  // never accepted as a center
+    if (row.count == row.capacity) {
+        row.capacity = row.capacity > 0 ? 2 * row.capacity : 256;
+        row.entries = (AtlasEntry*)realloc(row.entries, sizeof(AtlasEntry) * row.capacity);
+    }
+    row.entries[row.count++] = {(double)x, (double)y, steps, depth, 0, 0};
+}
+
+// Split the cell of the given size centered at (x, y) in quarters, recursively while their
+// escape counts differ.
+static void atlas_refine(AtlasRow& row, long double x, long double y, long double size,
+                         uint32_t depth) {
+    const long double q = size / 4;
+    const long double qx[4] = {x - q, x + q, x - q, x + q};
+    const long double qy[4] = {y - q, y - q, y + q, y + q};
+    uint32_t steps[4];
+    for (int k = 0; k < 4; k++) steps[k] = mandelbrot(qx[k], qy[k]);
+    const bool uniform = steps[0] == steps[1] && steps[1] == steps[2] && steps[2] == steps[3];
+    for (int k = 0; k < 4; k++) {
+        if (!uniform && depth < ATLAS_DEPTH)
+            atlas_refine(row, qx[k], qy[k], size / 2, depth + 1);
+        else
+            atlas_add(row, qx[k], qy[k], steps[k], depth + 1);
+    }
+}
+
+static void* build_atlas_rows(void* p) {
+    AtlasBuildData* data = (AtlasBuildData*)p;
+    const long double size = 1.0L / ATLAS_ROOT_CELLS;
+    for (int j = (*data->next)++; j < data->num_rows; j = (*data->next)++) {
+        const long double y = CENTER_YMIN + (j + 0.5L) * size;
+        for (int i = 0; i < data->num_cols; i++)
+            atlas_refine(data->rows[j], CENTER_XMIN + (i + 0.5L) * size, y, size, 0);
+    }
+    return NULL;
+}
+
+// Vose's alias method over the areas of the n entries of a band.
+static void build_alias(AtlasEntry* entries, uint32_t n, double root_size, double band_area) {
+    double* scaled = (double*)malloc(sizeof(double) * n);
+    uint32_t* small = (uint32_t*)malloc(sizeof(uint32_t) * n);
+    uint32_t* large = (uint32_t*)malloc(sizeof(uint32_t) * n);
+    uint32_t num_small = 0;
+    uint32_t num_large = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        const double area = ldexp(root_size * root_size, -2 * (int)entries[i].depth);
+        scaled[i] = area * n / band_area;
+        if (scaled[i] < 1)
+            small[num_small++] = i;
+        else
+            large[num_large++] = i;
+    }
+    while (num_small > 0 && num_large > 0) {
+        const uint32_t s = small[--num_small];
+        const uint32_t l = large[--num_large];
+        entries[s].prob = scaled[s];
+        entries[s].alias = l;
+        scaled[l] -= 1 - scaled[s];
+        if (scaled[l] < 1)
+            small[num_small++] = l;
+        else
+            large[num_large++] = l;
+    }
+    // Leftovers only differ from 1 by rounding errors.
+    while (num_large > 0) {
+        const uint32_t l = large[--num_large];
+        entries[l].prob = 1;
+        entries[l].alias = l;
+    }
+    while (num_small > 0) {
+        const uint32_t s = small[--num_small];
+        entries[s].prob = 1;
+        entries[s].alias = s;
+    }
+    free(scaled);
+    free(small);
+    free(large);
+}
+
+static int build_atlas(const char* filename, int num_threads) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    const int num_rows = (int)((CENTER_YMAX - CENTER_YMIN) * ATLAS_ROOT_CELLS);
+    const int num_cols = (int)((CENTER_XMAX - CENTER_XMIN) * ATLAS_ROOT_CELLS);
+    AtlasRow* rows = (AtlasRow*)calloc(num_rows, sizeof(AtlasRow));
+    std::atomic<int> next(0);
+    pthread_t thread[num_threads];
+    AtlasBuildData ab_data[num_threads];
+    for (int t = 0; t < num_threads; t++) {
+        ab_data[t] = {t, rows, num_rows, num_cols, &next};
+        create_thread(thread + t, build_atlas_rows, (void*)(ab_data + t));
+    }
+    for (int t = 0; t < num_threads; t++) pthread_join(thread[t], NULL);
+
+    AtlasHeader header = {};
+    memcpy(header.magic, ATLAS_MAGIC, sizeof(header.magic));
+    header.version = ATLAS_VERSION;
+    header.header_size = sizeof(AtlasHeader);
+    header.max_steps = max_steps;
+    header.root_size = 1.0 / ATLAS_ROOT_CELLS;
+    size_t count = 0;
+    for (int j = 0; j < num_rows; j++) count += rows[j].count;
+    if (count > UINT32_MAX) {
+        fprintf(stderr, "Error: too many atlas entries (%zu).\n", count);
+        for (int j = 0; j < num_rows; j++) free(rows[j].entries);
+        free(rows);
+        return 1;
+    }
+    header.count = count;
+    AtlasEntry* entries = (AtlasEntry*)malloc(sizeof(AtlasEntry) * (count > 0 ? count : 1));
+    count = 0;
+    for (int j = 0; j < num_rows; j++) {
+        memcpy(entries + count, rows[j].entries, sizeof(AtlasEntry) * rows[j].count);
+        count += rows[j].count;
+        free(rows[j].entries);
+    }
+    free(rows);
+
+    std::stable_sort(entries, entries + count, [](const AtlasEntry& a, const AtlasEntry& b) {
+        return atlas_band(a.steps) < atlas_band(b.steps);
+    });
+    for (size_t i = 0, b = 0; b <= ATLAS_BANDS; b++) {
+        while (i < count && atlas_band(entries[i].steps) < (int)b) i++;
+        header.band_start[b] = i;
+    }
+    for (int b = 0; b < ATLAS_BANDS; b++) {
+        AtlasEntry* band = entries + header.band_start[b];
+        const uint32_t n = header.band_start[b + 1] - header.band_start[b];
+        for (uint32_t i = 0; i < n; i++)
+            header.band_area[b] +=
+                ldexp(header.root_size * header.root_size, -2 * (int)band[i].depth);
+        if (n > 0) build_alias(band, n, header.root_size, header.band_area[b]);
+    }
+
+    struct iovec iov[2] = {{(void*)&header, sizeof(AtlasHeader)},
+                           {(void*)entries, sizeof(AtlasEntry) * count}};
+    const bool saved = write_file(filename, iov, 2);
+    free(entries);
 #ifdef DEBUG
-    printf("Thread %d: filling from %d to %d.\n", data->thread_id, data->start_line,
-           data->last_line - 1);
-    fflush(stdout);
+    printf("Atlas %s: %u entries built in %g ms.\n", filename, header.count, elapsed_ms(start));
 #endif
-    for (int j = data->start_line; j < data->last_line; j++) {
-        const long double v = (long double)j / (data->height - 1.0);
-        const long double y = LERP(data->ymin, data->ymax, v);
-        for (int i = 0; i < data->width; i++, b++) {
-            const long double u = (long double)i / (data->width - 1.0);
-            const long double x = LERP(data->xmin, data->xmax, u);
-            const uint32_t steps = 1 + mandelbrot(x, y);  // Add 1 due to log scaling
-            b->value = steps;
-            if (steps < data->smin) {
-                data->smin = steps;
-            } else if (steps > data->smax) {
-                data->smax = steps;
+    return saved ? 0 : 1;
+}
+
+static bool load_atlas(const char* filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: unable to open %s for reading.\n", filename);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(AtlasHeader)) {
+        fprintf(stderr, "Error: %s is not a valid atlas.\n", filename);
+        close(fd);
+        return false;
+    }
+    const size_t map_size = st.st_size;
+    void* map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error: unable to map %s in memory.\n", filename);
+        return false;
+    }
+    const AtlasHeader* header = (const AtlasHeader*)map;
+    bool valid = memcmp(header->magic, ATLAS_MAGIC, sizeof(header->magic)) == 0 &&
+                 header->version == ATLAS_VERSION &&
+                 header->header_size % sizeof(double) == 0 &&
+                 header->header_size >= sizeof(AtlasHeader) &&
+                 map_size >= header->header_size + sizeof(AtlasEntry) * header->count &&
+                 header->band_start[0] == 0 && header->band_start[ATLAS_BANDS] == header->count;
+    for (int b = 0; valid && b < ATLAS_BANDS; b++)
+        valid = header->band_start[b] <= header->band_start[b + 1];
+    if (!valid) {
+        fprintf(stderr, "Error: %s is not a valid atlas.\n", filename);
+        munmap(map, map_size);
+        return false;
+    }
+    atlas.header = header;
+    atlas.entries = (const AtlasEntry*)((const char*)map + header->header_size);
+    atlas.map_size = map_size;
+    return true;
+}
+
+// Draw a center from the atlas: a band is picked by area among the bands overlapping
+// [min_steps, max_steps), an entry of the band with its alias table (drawing again when the
+// entry is out of range, for bands partially in range), and the center is jittered inside the
+// cell of the entry if the escape count stays in range.  Returns 0 when no center is found.
+static uint32_t atlas_center(Random& rng, long double& x, long double& y) {
+    const AtlasHeader& header = *atlas.header;
+    double total = 0;
+    for (int b = 0; b < ATLAS_BANDS; b++)
+        if (atlas_band_in_range(b)) total += header.band_area[b];
+    if (total <= 0) return 0;
+
+    for (int draw = 0; draw < ATLAS_MAX_DRAWS; draw++) {
+        double u = random_range(rng, 0, total);
+        int band = -1;
+        for (int b = 0; b < ATLAS_BANDS && (band < 0 || u >= 0); b++) {
+            if (!atlas_band_in_range(b) || header.band_area[b] <= 0) continue;
+            band = b;
+            u -= header.band_area[b];
+        }
+        const uint32_t n = header.band_start[band + 1] - header.band_start[band];
+        const AtlasEntry* entries = atlas.entries + header.band_start[band];
+        const double v = random_range(rng, 0, n);
+        const uint32_t i = v < n ? (uint32_t)v : n - 1;
+        const AtlasEntry& entry = v - i < entries[i].prob ? entries[i] : entries[entries[i].alias];
+        if (entry.steps < min_steps || entry.steps >= max_steps) continue;
+
+        const long double half = ldexpl(header.root_size, -(int)entry.depth) / 2;
+        x = entry.x + random_range(rng, -half, half);
+        y = entry.y + random_range(rng, -half, half);
+        const uint32_t steps = mandelbrot(x, y);
+        if (steps >= min_steps && steps < max_steps) return steps;
+        x = entry.x;
+        y = entry.y;
+        return entry.steps;
+    }
+    return 0;
+}
+
+// Random centers are searched in parallel: candidate k of a search is a function of the
+// search seed and k only, threads test chunks of consecutive candidates and the accepted
+// candidate with the lowest index wins, so the result does not depend on the threads.  A
+// loaded atlas replaces the search.
+#define CENTER_CHUNK 16
+
+static inline uint32_t center_candidate(uint64_t seed, uint64_t k, long double& x,
+                                        long double& y) {
+    x = LERP(CENTER_XMIN, CENTER_XMAX, random_unit(seed, 2 * k));
+    y = LERP(CENTER_YMIN, CENTER_YMAX, random_unit(seed, 2 * k + 1));
+    return mandelbrot(x, y);
+}
+
+struct CenterSearchData {
+    uint64_t seed;
+    std::atomic<uint64_t>* next_chunk;
+    std::atomic<uint64_t>* found;  // lowest accepted candidate so far
+};
+
+static void* search_center(void* p) {
+    CenterSearchData* data = (CenterSearchData*)p;
+    for (;;) {
+        const uint64_t start = (*data->next_chunk)++ * CENTER_CHUNK;
+        if (start > *data->found) break;
+        for (uint64_t k = start; k < start + CENTER_CHUNK && k < *data->found; k++) {
+            long double x, y;
+            const uint32_t steps = center_candidate(data->seed, k, x, y);
+            if (steps >= min_steps && steps < max_steps) {
+                uint64_t found = *data->found;
+                while (k < found && !data->found->compare_exchange_weak(found, k));
+                break;
             }
         }
     }
-#ifdef DEBUG
-    printf("Thread %d: done.\n", data->thread_id);
-    fflush(stdout);
-#endif
     return NULL;
 }
 
-struct GenImageData {
-    int thread_id;
-    BufferData* buffer;
-    int start_line, last_line;
-    int width, height;
-    long double log_min, log_delta;
-    uint8_t* colormap;
-    int max_index;
-};
+static uint32_t choose_center(Random& rng, long double& x, long double& y, int num_threads) {
+    if (atlas.header != NULL) {
+        const uint32_t steps = atlas_center(rng, x, y);
+        if (steps > 0) return steps;
+    }
+    std::atomic<uint64_t> next_chunk(0);
+    std::atomic<uint64_t> found(UINT64_MAX);
+    CenterSearchData data = {random_next(rng), &next_chunk, &found};
+    if (num_threads <= 1) {
+        search_center(&data);
+    } else {
+        pthread_t thread[num_threads];
+        for (int t = 0; t < num_threads; t++)
+            create_thread(thread + t, search_center, (void*)&data);
+        for (int t = 0; t < num_threads; t++) pthread_join(thread[t], NULL);
+    }
+    return center_candidate(data.seed, found, x, y);
+}
+
+// Minibrot nucleus finder (--nucleus): the period of a point is estimated from its atom
+// domain (the iteration where |z| is the smallest before escaping), Newton's method converges
+// from the point to the nucleus of the nearest hyperbolic component with that period, and
+// the size of the component is estimated from the derivatives along its cycle.  The window
+// is then zoomed out from the minibrot by a random factor.
+#define NUCLEUS_NEWTON_STEPS 64
+#define NUCLEUS_MAX_ATTEMPTS 64
+#define NUCLEUS_MIN_ZOOM 1.5L
+#define NUCLEUS_MAX_ZOOM 64.0L
+
+typedef std::complex<long double> Complex;
+
+static uint32_t atom_period(Complex c) {
+    Complex z = 0;
+    long double min_mag = INFINITY;
+    uint32_t period = 0;
+    for (uint32_t n = 1; n <= max_steps; n++) {
+        z = z * z + c;
+        const long double mag = std::norm(z);
+        if (mag > 4) break;
+        if (mag < min_mag) {
+            min_mag = mag;
+            period = n;
+        }
+    }
+    return period;
+}
+
+static bool find_nucleus(Complex& c, uint32_t period) {
+    for (int k = 0; k < NUCLEUS_NEWTON_STEPS; k++) {
+        Complex z = 0;
+        Complex dz = 0;
+        for (uint32_t n = 0; n < period; n++) {
+            dz = 2.0L * z * dz + 1.0L;
+            z = z * z + c;
+        }
+        const Complex delta = z / dz;
+        c -= delta;
+        if (!std::isfinite(c.real()) || !std::isfinite(c.imag()) || std::norm(c) > 4)
+            return false;
+        if (std::abs(delta) <= 4 * LDBL_EPSILON * std::abs(c)) return true;
+    }
+    return false;
+}
+
+static long double nucleus_size(Complex c, uint32_t period) {
+    Complex z = 0;
+    Complex l = 1;
+    Complex b = 1;
+    for (uint32_t q = 1; q < period; q++) {
+        z = z * z + c;
+        l = 2.0L * z * l;
+        b += 1.0L / l;
+    }
+    return std::abs(1.0L / (b * l * l));
+}
 
-static void* gen_image(void* p) {
-    GenImageData* data = (GenImageData*)p;
-    BufferData* b = data->buffer + data->start_line * data->width;
+// Move the center (x, y) to the nucleus of the nearest minibrot and, unless size_set, size the
+// window after it.  Fails when no period is detected, when Newton's method diverges, and for
+// minibrots that cannot be rendered with max_steps iterations or long double coordinates.
+static bool nucleus_window(Random& rng, long double& x, long double& y, long double& dx,
+                           long double& dy, int width, int height, bool size_set) {
+    Complex c(x, y);
+    const uint32_t period = atom_period(c);
+    if (period == 0 || period > max_steps / 4 || !find_nucleus(c, period)) return false;
+    const long double size = nucleus_size(c, period);
+    if (!(size > 0) || !std::isfinite(size)) return false;
+
+    const long double half =
+        size_set ? dx
+                 : size * powl(2, random_range(rng, log2l(NUCLEUS_MIN_ZOOM),
+                                               log2l(NUCLEUS_MAX_ZOOM)));
+    if (2 * half / width < 16 * LDBL_EPSILON * (fabsl(c.real()) + fabsl(c.imag()))) return false;
 #ifdef DEBUG
-    printf("Thread %d: generating image from %d to %d.\n", data->thread_id, data->start_line,
-           data->last_line - 1);
-    fflush(stdout);
+    printf("Nucleus of period %u at (%.21Lg, %.21Lg), size %Lg.\n", period, c.real(), c.imag(),
+           size);
 #endif
-    for (int j = data->start_line; j < data->last_line; j++) {
-        for (int i = 0; i < data->width; i++, b++) {
-            long double value = (log(b->value) - data->log_min) / data->log_delta;
-            if (value < 0)
-                value = 0;
-            else if (value > 1)
-                value = 1;
-            const int index = int(0.5 + value * data->max_index);
-            const uint8_t* sample = data->colormap + 3 * index;
-            b->r = *sample++;
-            b->g = *sample++;
-            b->b = *sample++;
-            b->a = 0xFF;
-        }
+    x = c.real();
+    y = c.imag();
+    if (!size_set) {
+        dx = half;
+        dy = dx * height / width;
     }
+    return true;
+}
+
+// Pick the view window: a random center unless center_set, and a random size (depending on
+// the number of iterations at the center) unless size_set.  With nucleus, random centers are
+// moved to a minibrot nucleus (see nucleus_window).
+static void choose_window(Random& rng, long double& x, long double& y, long double& dx,
+                          long double& dy, int width, int height, bool center_set,
+                          bool size_set, bool nucleus, int num_threads) {
+    if (nucleus && !center_set) {
+        for (int attempt = 0; attempt < NUCLEUS_MAX_ATTEMPTS; attempt++) {
+            choose_center(rng, x, y, num_threads);
+            if (nucleus_window(rng, x, y, dx, dy, width, height, size_set)) return;
+        }
 #ifdef DEBUG
-    printf("Thread %d: done.\n", data->thread_id);
-    fflush(stdout);
+        printf("No minibrot nucleus found, using a random window.\n");
 #endif
+    }
+
+    uint32_t steps;
+    if (center_set)
+        steps = mandelbrot(x, y);
+    else
+        steps = choose_center(rng, x, y, num_threads);
+
+    if (!size_set) {
+        dx = powl(steps, random_range(rng, -2.5, -1));
+        dy = dx * height / width;
+    }
+}
+
+// Interest-scored window search (--search): candidate windows are drawn as in choose_window
+// (candidate k from its own random stream), evaluated in parallel on tiny previews, and the
+// one with the best score is used.  Candidates are processed in batches and the result only
+// depends on the seed, unless the time budget stops the search early.
+#define SEARCH_PREVIEW_WIDTH 64
+#define SEARCH_HISTOGRAM_BINS 32
+#define SEARCH_BATCH_PER_THREAD 4
+
+struct SearchCandidate {
+    long double x, y, dx, dy;
+    double score;
+};
+
+struct SearchData {
+    int thread_id;
+    SearchCandidate* candidates;
+    int first, count;  // index of the first candidate of the batch and batch size
+    uint64_t seed;
+    int image_width, image_height;
+    bool center_set, size_set, nucleus;
+    int width, height;  // preview size
+    std::atomic<int>* next;
+};
+
+// Score a window from its preview: the entropy of the (logarithmic) iteration histogram,
+// weighted by the density of edges between neighbors (best around one half, as very high
+// densities are just noise) and by the fraction of samples that escape.
+static double window_score(const uint32_t* steps, int width, int height) {
+    const size_t count = (size_t)width * height;
+    const double log_max = log(max_steps + 1.0);
+    int histogram[SEARCH_HISTOGRAM_BINS] = {0};
+    size_t interior = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (steps[i] > max_steps) interior++;
+        int bin = (int)(log((double)steps[i]) / log_max * SEARCH_HISTOGRAM_BINS);
+        if (bin >= SEARCH_HISTOGRAM_BINS) bin = SEARCH_HISTOGRAM_BINS - 1;
+        histogram[bin]++;
+    }
+    double entropy = 0;
+    for (int b = 0; b < SEARCH_HISTOGRAM_BINS; b++) {
+        if (histogram[b] == 0) continue;
+        const double p = (double)histogram[b] / count;
+        entropy -= p * log(p);
+    }
+    entropy /= log((double)SEARCH_HISTOGRAM_BINS);
+
+    size_t edges = 0, pairs = 0;
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            const uint32_t s = steps[(size_t)j * width + i];
+            if (i + 1 < width) {
+                pairs++;
+                if (steps[(size_t)j * width + i + 1] != s) edges++;
+            }
+            if (j + 1 < height) {
+                pairs++;
+                if (steps[(size_t)(j + 1) * width + i] != s) edges++;
+            }
+        }
+    }
+    const double edge_density = pairs > 0 ? (double)edges / pairs : 0;
+
+    return entropy * (0.5 + 2 * edge_density * (1 - edge_density)) *
+           (1 - (double)interior / count);
+}
+
+static void* search_windows(void* p) {
+    SearchData* data = (SearchData*)p;
+    uint32_t* steps = (uint32_t*)malloc(sizeof(uint32_t) * data->width * data->height);
+    for (int k = (*data->next)++; k < data->count; k = (*data->next)++) {
+        SearchCandidate& candidate = data->candidates[k];
+        Random rng = {random_bits(data->seed, data->first + k), 0};
+        choose_window(rng, candidate.x, candidate.y, candidate.dx, candidate.dy,
+                      data->image_width, data->image_height, data->center_set, data->size_set,
+                      data->nucleus, 1);
+        uint32_t* b = steps;
+        for (int j = 0; j < data->height; j++) {
+            const long double y = pixel_coordinate(candidate.y - candidate.dy,
+                                                   candidate.y + candidate.dy, j, data->height);
+            for (int i = 0; i < data->width; i++, b++) {
+                const long double x = pixel_coordinate(
+                    candidate.x - candidate.dx, candidate.x + candidate.dx, i, data->width);
+                *b = 1 + mandelbrot(x, y);
+            }
+        }
+        candidate.score = window_score(steps, data->width, data->height);
+    }
+    free(steps);
     return NULL;
 }
 
-int main(int argc, char* argv[]) {
-    const uint8_t* colormaps[] = {acton, bamako,  batlow, berlin, bilbao, broc,   broco,
-                                  buda,  cork,    corko,  davos,  devon,  grayc,  hawaii,
-                                  imola, lajolla, lapaz,  lisbon, nuuk,   oleron, oslo,
-                                  roma,  romao,   tofino, tokyo,  turku,  vik,    viko};
-    const int colormap_sizes[] = {
-        COUNT(acton), COUNT(bamako), COUNT(batlow), COUNT(berlin),  COUNT(bilbao), COUNT(broc),
-        COUNT(broco), COUNT(buda),   COUNT(cork),   COUNT(corko),   COUNT(davos),  COUNT(devon),
-        COUNT(grayc), COUNT(hawaii), COUNT(imola),  COUNT(lajolla), COUNT(lapaz),  COUNT(lisbon),
-        COUNT(nuuk),  COUNT(oleron), COUNT(oslo),   COUNT(roma),    COUNT(romao),  COUNT(tofino),
-        COUNT(tokyo), COUNT(turku),  COUNT(vik),    COUNT(viko)};
-    const char* colormap_names[] = {"acton", "bamako", "batlow", "berlin",  "bilbao", "broc",
-                                    "broco", "buda",   "cork",   "corko",   "davos",  "devon",
-                                    "grayc", "hawaii", "imola",  "lajolla", "lapaz",  "lisbon",
-                                    "nuuk",  "oleron", "oslo",   "roma",    "romao",  "tofino",
-                                    "tokyo", "turku",  "vik",    "viko"};
+// Choose the most interesting of count candidate windows within time_budget ms.
+static void search_window(Random& rng, long double& x, long double& y, long double& dx,
+                          long double& dy, int width, int height, bool center_set,
+                          bool size_set, bool nucleus, int count, double time_budget,
+                          int num_threads) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    const char* filename = NULL;
-    int wid = 960;
-    int hei = 540;
-    bool center_set = false;
-    bool size_set = false;
-    long double x = 0;
-    long double y = 0;
-    long double dx = 0;
-    long double dy = 0;
-    int cmap_choice = -1;
-    unsigned int seed = time(NULL);
-    int num_threads = get_nprocs() - 1;
-    if (num_threads <= 0) num_threads = 1;
+    const uint64_t seed = random_next(rng);
+    const int batch = SEARCH_BATCH_PER_THREAD * num_threads;
+    SearchCandidate* candidates = (SearchCandidate*)malloc(sizeof(SearchCandidate) * batch);
+    SearchCandidate best = {x, y, dx, dy, -1};
+    int preview_height = SEARCH_PREVIEW_WIDTH * height / width;
+    if (preview_height < 2) preview_height = 2;
 
-    for (int i = 1; i < argc; i++) {
+    int evaluated = 0;
+    while (evaluated < count && (evaluated == 0 || time_budget <= 0 ||
+                                 elapsed_ms(start) < time_budget)) {
+        int size = count - evaluated < batch ? count - evaluated : batch;
+        for (int k = 0; k < size; k++) candidates[k] = {x, y, dx, dy, 0};
+
+        std::atomic<int> next(0);
+        pthread_t thread[num_threads];
+        SearchData sd_data[num_threads];
+        for (int t = 0; t < num_threads; t++) {
+            sd_data[t] = {t,        candidates, evaluated, size,    seed,
+                          width,    height,     center_set, size_set, nucleus,
+                          SEARCH_PREVIEW_WIDTH, preview_height, &next};
+            create_thread(thread + t, search_windows, (void*)(sd_data + t));
+        }
+        for (int t = 0; t < num_threads; t++) pthread_join(thread[t], NULL);
+
+        for (int k = 0; k < size; k++)
+            if (candidates[k].score > best.score) best = candidates[k];
+        evaluated += size;
+    }
 #ifdef DEBUG
-        printf("Parsing argument %s\n", argv[i]);
+    printf("Window search: %d of %d candidates evaluated in %g ms, best score %g.\n", evaluated,
+           count, elapsed_ms(start), best.score);
 #endif
-        if (argv[i][0] != '-') {
-            filename = argv[i];
+    x = best.x;
+    y = best.y;
+    dx = best.dx;
+    dy = best.dy;
+    free(candidates);
+}
+
+// Bands of rows are handed out to the calc_buffer threads on demand, in the order given by
+// the schedule (most expensive bands first when a cost estimate is available), so that the
+// threads stay busy until the end regardless of how the work is distributed in the image.
+#define CALC_BAND_LINES 8
+
+struct BandSchedule {
+    int band_lines, num_bands;
+    const int* order;  // processing order of the bands (NULL for top to bottom)
+    std::atomic<int> next;
+};
+
+// The set is symmetric about the real axis and the iteration commutes exactly with complex
+// conjugation, so rows whose y is exactly the negation of the y of another row are not
+// computed but copied from it.  mirror[j] is the row mirrored by row j, or -1 for the rows
+// to compute.  Returns NULL when no row can be mirrored.
+static int* mirror_rows(long double ymin, long double ymax, int height) {
+    if (!(ymin < 0 && ymax > 0)) return NULL;
+    int* mirror = (int*)malloc(sizeof(int) * height);
+    int count = 0;
+    for (int j = 0; j < height; j++) {
+        mirror[j] = -1;
+        const long double y = pixel_coordinate(ymin, ymax, j, height);
+        if (y >= 0) continue;
+        // Rounding may put the exact mirror next to the nearest row, if there is one at all.
+        const long nearest = lroundl((-y - ymin) / (ymax - ymin) * (height - 1));
+        for (long k = nearest - 1; k <= nearest + 1; k++) {
+            if (k < 0 || k >= height || pixel_coordinate(ymin, ymax, k, height) != -y) continue;
+            mirror[j] = k;
+            count++;
+            break;
+        }
+    }
 #ifdef DEBUG
-            printf("Output filename: %s\n", filename);
+    printf("Mirroring %d of %d rows.\n", count, height);
 #endif
-            continue;
+    if (count == 0) {
+        free(mirror);
+        return NULL;
+    }
+    return mirror;
+}
+
+// Interval proofs (--prove): bands are split in tiles of PROOF_TILE_WIDTH columns and each
+// tile is first iterated as a whole, with interval arithmetic over the rectangle spanned by
+// the coordinates of its pixels.  The intervals apply the operations of iterate in the same
+// order and rounding, so by monotony of the rounding they contain the values computed for
+// every pixel of the tile.  The tile is filled without evaluating its pixels when they all
+// escape at the same iteration, or when an iterate of the rectangle falls inside an earlier
+// one: the orbits then stay in a cycle of rectangles which never escape.
+#define PROOF_TILE_WIDTH 16
+
+struct Interval {
+    long double lo, hi;
+};
+
+static inline Interval operator+(Interval a, Interval b) { return {a.lo + b.lo, a.hi + b.hi}; }
+
+static inline Interval operator-(Interval a, Interval b) { return {a.lo - b.hi, a.hi - b.lo}; }
+
+static inline Interval operator*(Interval a, Interval b) {
+    const long double p[4] = {a.lo * b.lo, a.lo * b.hi, a.hi * b.lo, a.hi * b.hi};
+    return {std::min({p[0], p[1], p[2], p[3]}), std::max({p[0], p[1], p[2], p[3]})};
+}
+
+static inline Interval square(Interval a) {
+    const long double lo = a.lo * a.lo;
+    const long double hi = a.hi * a.hi;
+    if (a.lo >= 0) return {lo, hi};
+    if (a.hi <= 0) return {hi, lo};
+    return {0, lo > hi ? lo : hi};
+}
+
+static inline bool contains(Interval a, Interval b) { return a.lo <= b.lo && b.hi <= a.hi; }
+
+// Try to prove that all the pixels of the rectangle x * y take the same number of steps.
+// Pixels that never escape (steps == max_steps) are only accepted if allow_limited.
+static bool prove_tile(Interval x, Interval y, bool allow_limited, uint32_t& steps) {
+    Interval r = x;
+    Interval i = y;
+    Interval mag_sq = square(r) + square(i);
+    Interval saved_r = r;
+    Interval saved_i = i;
+    uint32_t checkpoint = 1;
+    for (steps = 0; steps < max_steps;) {
+        if (mag_sq.lo > 4) return true;
+        if (mag_sq.hi > 4) return false;
+        const Interval rr = square(r) - square(i) + x;
+        i = Interval{2 * r.lo, 2 * r.hi} * i + y;
+        r = rr;
+        mag_sq = square(r) + square(i);
+        steps++;
+        if (contains(saved_r, r) && contains(saved_i, i)) {
+            steps = max_steps;
+            break;
         }
-        switch (argv[i][1]) {
-            case 'h':
-                printf(
-                    "Usage: %s [OPTION]... FILENAME\n\n"
-                    "Options:\n"
-                    "  -h                    Show this help message and exit.\n"
-                    "  -g WIDTH HEIGHT       Image size (defaults %d %d).\n"
-                    "  -c X Y                View window center.\n"
-                    "  -s DX DY              View window size.\n"
-                    "  -z MIN MAX            Minimal value to accept a random "
-                    "coordinate as image\n"
+        if (steps == checkpoint) {
+            saved_r = r;
+            saved_i = i;
+            checkpoint *= 2;
+        }
+    }
+    return allow_limited;
+}
+
+template <typename Sample>
+struct CalcBufferData {
+    int thread_id;
+    Sample* buffer;
+    BandSchedule* schedule;
+    int width, height;
+    uint32_t smin, smax;
+    long double xmin, xmax, ymin, ymax;
+    const int* mirror;  // rows to skip (see mirror_rows) or NULL
+    bool keep_state;    // collect the state of the pixels reaching max_steps
+    StepState* states;
+    size_t state_count, state_capacity;
+    bool prove;  // try interval proofs on tiles first
+    int interior_tiles, escape_tiles, fallback_tiles;
+    int stride;  // pixel spacing of the progressive level (see calc_level)
+};
+
+static void add_state(StepState*& states, size_t& count, size_t& capacity, uint64_t index,
+                      long double r, long double i) {
+    if (count == capacity) {
+        capacity = capacity > 0 ? 2 * capacity : 1024;
+        states = (StepState*)realloc(states, sizeof(StepState) * capacity);
+    }
+    StepState& state = states[count++];
+    state.index = index;
+    split_coordinate(r, state.r);
+    split_coordinate(i, state.i);
+}
+
+// Copy the mirrored rows from their source rows, together with the (conjugated) states of
+// their limited pixels.  states must be sorted by index and stay so.
+template <typename Sample>
+static void copy_mirrored_rows(Sample* buffer, int width, int height, const int* mirror,
+                               StepState*& states, size_t& state_count) {
+    const size_t source_count = state_count;
+    size_t state_capacity = state_count;
+    for (int j = 0; j < height; j++) {
+        if (mirror[j] < 0) continue;
+        memcpy(buffer + (size_t)j * width, buffer + (size_t)mirror[j] * width,
+               sizeof(Sample) * width);
+        if (source_count == 0) continue;
+        const uint64_t first = (uint64_t)mirror[j] * width;
+        size_t k = std::lower_bound(states, states + source_count, first,
+                                    [](const StepState& state, uint64_t index) {
+                                        return state.index < index;
+                                    }) -
+                   states;
+        for (; k < source_count && states[k].index < first + width; k++) {
+            StepState copy = states[k];
+            copy.index = (uint64_t)j * width + (states[k].index - first);
+            split_coordinate(-join_coordinate(copy.i), copy.i);
+            add_state(states, state_count, state_capacity, 0, 0, 0);
+            states[state_count - 1] = copy;
+        }
+    }
+    std::sort(states, states + state_count,
+              [](const StepState& a, const StepState& b) { return a.index < b.index; });
+}
+
+template <typename Sample>
+static inline void calc_pixel(CalcBufferData<Sample>* data, Sample* b, long double x,
+                              long double y, bool keep_state) {
+    uint32_t steps;
+    if (!keep_state) {
+        steps = 1 + mandelbrot(x, y);  // Add 1 due to log scaling
+    } else {
+        long double zr = x;
+        long double zi = y;
+        steps = 1 + iterate(x, y, zr, zi, 0, max_steps);
+        if (steps > max_steps)
+            add_state(data->states, data->state_count, data->state_capacity, b - data->buffer,
+                      zr, zi);
+    }
+    *b = (Sample)steps;
+    if (steps < data->smin) data->smin = steps;
+    if (steps > data->smax) data->smax = steps;
+}
+
+// Compute the pixels of columns [i0, i1) of rows [j0, j1).
+template <typename Sample>
+static inline void calc_pixels(CalcBufferData<Sample>* data, int j0, int j1, int i0, int i1) {
+    for (int j = j0; j < j1; j++) {
+        if (data->mirror != NULL && data->mirror[j] >= 0) continue;
+        const long double y = pixel_coordinate(data->ymin, data->ymax, j, data->height);
+        Sample* b = data->buffer + (size_t)j * data->width + i0;
+        for (int i = i0; i < i1 && !job_cancelled(); i++, b++)
+            calc_pixel(data, b, pixel_coordinate(data->xmin, data->xmax, i, data->width), y,
+                       data->keep_state);
+    }
+}
+
+template <typename Sample>
+static void* calc_buffer(void* p) {
+    CalcBufferData<Sample>* data = (CalcBufferData<Sample>*)p;
+    BandSchedule* schedule = data->schedule;
+    for (int k = schedule->next++; k < schedule->num_bands && !job_cancelled();
+         k = schedule->next++) {
+        const int band = schedule->order ? schedule->order[k] : k;
+        const int start_line = band * schedule->band_lines;
+        int last_line = start_line + schedule->band_lines;
+        if (last_line > data->height) last_line = data->height;
+#ifdef DEBUG
+        printf("Thread %d: filling from %d to %d.\n", data->thread_id, start_line,
+               last_line - 1);
+        fflush(stdout);
+#endif
+        int first_line = start_line;  // first computed row
+        while (first_line < last_line && data->mirror != NULL && data->mirror[first_line] >= 0)
+            first_line++;
+        if (!data->prove || first_line == last_line) {
+            calc_pixels(data, start_line, last_line, 0, data->width);
+            continue;
+        }
+        const Interval y = {pixel_coordinate(data->ymin, data->ymax, start_line, data->height),
+                            pixel_coordinate(data->ymin, data->ymax, last_line - 1,
+                                             data->height)};
+        for (int i0 = 0; i0 < data->width; i0 += PROOF_TILE_WIDTH) {
+            const int i1 = i0 + PROOF_TILE_WIDTH < data->width ? i0 + PROOF_TILE_WIDTH
+                                                               : data->width;
+            const Interval x = {pixel_coordinate(data->xmin, data->xmax, i0, data->width),
+                                pixel_coordinate(data->xmin, data->xmax, i1 - 1, data->width)};
+            uint32_t steps;
+            if (!prove_tile(x, y, !data->keep_state, steps)) {
+                data->fallback_tiles++;
+                calc_pixels(data, start_line, last_line, i0, i1);
+                continue;
+            }
+            if (steps < max_steps)
+                data->escape_tiles++;
+            else
+                data->interior_tiles++;
+            const uint32_t sample = steps + 1;
+            for (int j = start_line; j < last_line; j++)
+                for (int i = i0; i < i1; i++)
+                    data->buffer[(size_t)j * data->width + i] = (Sample)sample;
+            if (sample < data->smin) data->smin = sample;
+            if (sample > data->smax) data->smax = sample;
+        }
+    }
+#ifdef DEBUG
+    printf("Thread %d: done.\n", data->thread_id);
+    fflush(stdout);
+#endif
+    return NULL;
+}
+
+static const uint8_t* colormaps[] = {acton, bamako,  batlow, berlin, bilbao, broc,   broco,
+                                     buda,  cork,    corko,  davos,  devon,  grayc,  hawaii,
+                                     imola, lajolla, lapaz,  lisbon, nuuk,   oleron, oslo,
+                                     roma,  romao,   tofino, tokyo,  turku,  vik,    viko};
+static const int colormap_sizes[] = {
+    COUNT(acton), COUNT(bamako), COUNT(batlow), COUNT(berlin),  COUNT(bilbao), COUNT(broc),
+    COUNT(broco), COUNT(buda),   COUNT(cork),   COUNT(corko),   COUNT(davos),  COUNT(devon),
+    COUNT(grayc), COUNT(hawaii), COUNT(imola),  COUNT(lajolla), COUNT(lapaz),  COUNT(lisbon),
+    COUNT(nuuk),  COUNT(oleron), COUNT(oslo),   COUNT(roma),    COUNT(romao),  COUNT(tofino),
+    COUNT(tokyo), COUNT(turku),  COUNT(vik),    COUNT(viko)};
+static const char* colormap_names[] = {"acton",  "bamako", "batlow",  "berlin", "bilbao",
+                                       "broc",   "broco",  "buda",    "cork",   "corko",
+                                       "davos",  "devon",  "grayc",   "hawaii", "imola",
+                                       "lajolla", "lapaz", "lisbon",  "nuuk",   "oleron",
+                                       "oslo",   "roma",   "romao",   "tofino", "tokyo",
+                                       "turku",  "vik",    "viko"};
+
+// Build the color lookup table for sample values in [smin, smax]: palette[s - smin] is the
+// color of sample value s.
+static void build_palette(BufferData* palette, uint32_t smin, uint32_t smax,
+                          long double log_min, long double log_delta, const uint8_t* colormap,
+                          int max_index) {
+    for (uint32_t s = smin; s <= smax; s++) {
+        long double value = (log(s) - log_min) / log_delta;
+        if (value < 0)
+            value = 0;
+        else if (value > 1)
+            value = 1;
+        const int index = int(0.5 + value * max_index);
+        const uint8_t* sample = colormap + 3 * index;
+        BufferData* b = palette + (s - smin);
+        b->r = *sample++;
+        b->g = *sample++;
+        b->b = *sample++;
+        b->a = 0xFF;
+    }
+}
+
+template <typename Sample>
+static inline void colorize(const Sample* steps, BufferData* image, size_t count, uint32_t smin,
+                            uint32_t smax, const BufferData* palette) {
+    for (size_t i = 0; i < count; i++) {
+        uint32_t s = steps[i];
+        if (s < smin)
+            s = smin;
+        else if (s > smax)
+            s = smax;
+        image[i] = palette[s - smin];
+    }
+}
+
+// PNG encoding with rows generated on demand.  Each thread produces its rows directly into
+// a 2-line scratch buffer and filters them into the scanline buffer that is compressed, so
+// the full RGBA frame is never stored.  Filter selection and compression are the same as in
+// stbi_write_png.
+typedef void (*FillRow)(void* context, int row, BufferData* pixels);
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t* data, size_t len) {
+    static uint32_t table[256];
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, [] {
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            table[n] = c;
+        }
+    });
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static bool write_png_chunk(FILE* out, const char* tag, const uint8_t* data, uint32_t len) {
+    const uint8_t head[8] = {uint8_t(len >> 24), uint8_t(len >> 16), uint8_t(len >> 8),
+                             uint8_t(len),       uint8_t(tag[0]),    uint8_t(tag[1]),
+                             uint8_t(tag[2]),    uint8_t(tag[3])};
+    const uint32_t crc = crc32_update(crc32_update(0, head + 4, 4), data, len);
+    const uint8_t tail[4] = {uint8_t(crc >> 24), uint8_t(crc >> 16), uint8_t(crc >> 8),
+                             uint8_t(crc)};
+    return fwrite(head, 1, 8, out) == 8 && fwrite(data, 1, len, out) == len &&
+           fwrite(tail, 1, 4, out) == 4;
+}
+
+static bool write_png_header(FILE* out, int width, int height) {
+    static const uint8_t signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    const uint8_t ihdr[13] = {uint8_t(width >> 24),  uint8_t(width >> 16), uint8_t(width >> 8),
+                              uint8_t(width),        uint8_t(height >> 24), uint8_t(height >> 16),
+                              uint8_t(height >> 8),  uint8_t(height),       8,
+                              6,                     0,                     0,
+                              0};
+    return fwrite(signature, 1, 8, out) == 8 && write_png_chunk(out, "IHDR", ihdr, 13);
+}
+
+// Filter a row into line (4 * width bytes) with the filter type stbi_write_png would choose.
+// The current row must be at scratch (first row) or right after the previous one.  Rows
+// marked as independent are at scratch and are filtered without looking at the previous
+// row, which limits the choice to the None and Sub filters except for the first row.
+static int filter_row(uint8_t* scratch, int width, int row, bool independent,
+                      signed char* line) {
+    const int stride = 4 * width;
+    const int y = (row == 0 || independent) ? 0 : 1;
+    const int num_filters = (row > 0 && independent) ? 2 : 5;
+    int best_filter = 0, best_filter_val = 0x7FFFFFFF;
+    int filter_type;
+    for (filter_type = 0; filter_type < num_filters; filter_type++) {
+        stbiw__encode_png_line(scratch, stride, width, 2, y, 4, filter_type, line);
+        int est = 0;
+        for (int i = 0; i < stride; i++) est += abs(line[i]);
+        if (est < best_filter_val) {
+            best_filter_val = est;
+            best_filter = filter_type;
+        }
+    }
+    if (filter_type != best_filter)
+        stbiw__encode_png_line(scratch, stride, width, 2, y, 4, best_filter, line);
+    return best_filter;
+}
+
+struct FilterRowsData {
+    int thread_id;
+    FillRow fill_row;
+    void* context;
+    int start_line, last_line;
+    int width;
+    uint8_t* filtered;
+};
+
+static void* filter_rows(void* p) {
+    FilterRowsData* data = (FilterRowsData*)p;
+    const int stride = 4 * data->width;
+    uint8_t* scratch = (uint8_t*)malloc(3 * stride);
+    BufferData* previous = (BufferData*)scratch;
+    BufferData* current = (BufferData*)(scratch + stride);
+    signed char* line = (signed char*)(scratch + 2 * stride);
+    if (data->start_line > 0) data->fill_row(data->context, data->start_line - 1, previous);
+    for (int j = data->start_line; j < data->last_line; j++) {
+        uint8_t* out = data->filtered + (size_t)j * (stride + 1);
+        if (j == 0) {
+            data->fill_row(data->context, j, previous);
+            out[0] = (uint8_t)filter_row(scratch, data->width, j, false, line);
+        } else {
+            data->fill_row(data->context, j, current);
+            out[0] = (uint8_t)filter_row(scratch, data->width, j, false, line);
+            memcpy(previous, current, stride);
+        }
+        memcpy(out + 1, line, stride);
+    }
+    free(scratch);
+    return NULL;
+}
+
+// Write an RGBA PNG whose rows are generated by fill_row, using num_threads threads for
+// colorization and filtering.
+static bool write_png(const char* filename, int width, int height, FillRow fill_row,
+                      void* context, int num_threads) {
+    const size_t filtered_size = (size_t)(4 * width + 1) * height;
+    uint8_t* filtered = (uint8_t*)malloc(filtered_size);
+    if (num_threads > height) num_threads = height;
+
+    pthread_t thread[num_threads];
+    FilterRowsData fr_data[num_threads];
+    for (int t = 0; t < num_threads; t++) {
+        fr_data[t] = {t,
+                      fill_row,
+                      context,
+                      t * height / num_threads,
+                      (t + 1) * height / num_threads,
+                      width,
+                      filtered};
+        create_thread(thread + t, filter_rows, (void*)(fr_data + t));
+    }
+    for (int t = 0; t < num_threads; t++) pthread_join(thread[t], NULL);
+
+    int zlen;
+    uint8_t* zlib = stbi_zlib_compress(filtered, (int)filtered_size, &zlen,
+                                       stbi_write_png_compression_level);
+    free(filtered);
+    if (zlib == NULL) return false;
+
+    FILE* out = open_output(filename);
+    if (out == NULL) {
+        free(zlib);
+        return false;
+    }
+    bool success = write_png_header(out, width, height) &&
+                   write_png_chunk(out, "IDAT", zlib, zlen) &&
+                   write_png_chunk(out, "IEND", NULL, 0);
+    free(zlib);
+    success = (fclose(out) == 0) && success;
+    return success;
+}
+
+// Raw frame stream (--stream FORMAT): the images are written to a single output as
+// uncompressed frames, either YUV4MPEG2 (4:4:4, BT.601 limited range) or bare RGBA, for
+// video encoders to read from a pipe.  Frames are colorized (and converted) by the renderer
+// threads into one of STREAM_QUEUE buffers, and a writer thread writes them in order, so that
+// the next frames are computed while the previous ones are written.
+#define STREAM_QUEUE 4
+#define STREAM_FPS 30
+
+struct FrameStream {
+    FILE* out;
+    bool y4m;
+    int width, height;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    uint8_t* pending[STREAM_QUEUE];  // colorized frame next + k at (next + k) % STREAM_QUEUE
+    int next;                        // next frame to write
+    bool closed;                     // no more frames
+    bool failed;
+    pthread_t writer;
+};
+
+static inline size_t frame_size(const FrameStream* stream) {
+    return (size_t)(stream->y4m ? 3 : 4) * stream->width * stream->height;
+}
+
+static void* write_frames(void* p) {
+    FrameStream* stream = (FrameStream*)p;
+    pthread_mutex_lock(&stream->lock);
+    for (;;) {
+        uint8_t* frame = stream->pending[stream->next % STREAM_QUEUE];
+        if (frame == NULL) {
+            if (stream->closed) break;
+            pthread_cond_wait(&stream->changed, &stream->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&stream->lock);
+        bool success = !stream->failed;
+        if (success && stream->y4m) success = fputs("FRAME\n", stream->out) >= 0;
+        if (success)
+            success = fwrite(frame, 1, frame_size(stream), stream->out) == frame_size(stream);
+        free(frame);
+        pthread_mutex_lock(&stream->lock);
+        if (!success) stream->failed = true;
+        stream->pending[stream->next % STREAM_QUEUE] = NULL;
+        stream->next++;
+        pthread_cond_broadcast(&stream->changed);
+    }
+    pthread_mutex_unlock(&stream->lock);
+    return NULL;
+}
+
+// Start streaming width x height frames to out (which the stream then owns).
+static void open_stream(FrameStream* stream, FILE* out, bool y4m, int width, int height) {
+    *stream = {out, y4m, width, height, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+               {},  0,   false, false, {}};
+    if (y4m && fprintf(out, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", width, height,
+                       STREAM_FPS) < 0)
+        stream->failed = true;
+    create_thread(&stream->writer, write_frames, stream);
+}
+
+// Write the pending frames and close the output.
+static bool close_stream(FrameStream* stream) {
+    pthread_mutex_lock(&stream->lock);
+    stream->closed = true;
+    pthread_cond_broadcast(&stream->changed);
+    pthread_mutex_unlock(&stream->lock);
+    pthread_join(stream->writer, NULL);
+    return (fclose(stream->out) == 0) && !stream->failed;
+}
+
+struct StreamRowsData {
+    FillRow fill_row;
+    void* context;
+    int start_line, last_line;
+    const FrameStream* stream;
+    uint8_t* frame;
+};
+
+static void* stream_rows(void* p) {
+    StreamRowsData* data = (StreamRowsData*)p;
+    const int width = data->stream->width;
+    const size_t plane = (size_t)width * data->stream->height;
+    BufferData* line = (BufferData*)malloc(sizeof(BufferData) * width);
+    for (int j = data->start_line; j < data->last_line; j++) {
+        if (!data->stream->y4m) {
+            data->fill_row(data->context, j, (BufferData*)(data->frame + 4 * (size_t)j * width));
+            continue;
+        }
+        data->fill_row(data->context, j, line);
+        uint8_t* y = data->frame + (size_t)j * width;
+        for (int i = 0; i < width; i++) {
+            const int r = line[i].r, g = line[i].g, b = line[i].b;
+            y[i] = (uint8_t)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+            y[plane + i] = (uint8_t)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+            y[2 * plane + i] = (uint8_t)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+        }
+    }
+    free(line);
+    return NULL;
+}
+
+// Colorize frame number frame (counted from 0 over the whole stream) with fill_row, using
+// num_threads threads, and queue it for writing.  Waits while the queue is full.
+static bool stream_frame(FrameStream* stream, int frame, FillRow fill_row, void* context,
+                         int num_threads) {
+    pthread_mutex_lock(&stream->lock);
+    while (frame >= stream->next + STREAM_QUEUE)
+        pthread_cond_wait(&stream->changed, &stream->lock);
+    pthread_mutex_unlock(&stream->lock);
+
+    uint8_t* buffer = (uint8_t*)malloc(frame_size(stream));
+    if (num_threads > stream->height) num_threads = stream->height;
+    pthread_t thread[num_threads];
+    StreamRowsData sr_data[num_threads];
+    for (int t = 0; t < num_threads; t++) {
+        sr_data[t] = {fill_row,
+                      context,
+                      t * stream->height / num_threads,
+                      (t + 1) * stream->height / num_threads,
+                      stream,
+                      buffer};
+        create_thread(thread + t, stream_rows, (void*)(sr_data + t));
+    }
+    for (int t = 0; t < num_threads; t++) pthread_join(thread[t], NULL);
+
+    pthread_mutex_lock(&stream->lock);
+    stream->pending[frame % STREAM_QUEUE] = buffer;
+    pthread_cond_broadcast(&stream->changed);
+    const bool success = !stream->failed;
+    pthread_mutex_unlock(&stream->lock);
+    return success;
+}
+
+// Raw deflate of one band of a zlib stream, using the same fixed Huffman encoder as
+// stbi_zlib_compress.  Bands other than the last end with an empty stored block so that
+// the next band starts at a byte boundary and independently compressed bands can simply be
+// concatenated.
+static uint8_t* deflate_band(uint8_t* data, int data_len, int quality, bool last,
+                             int* out_len) {
+    static unsigned short lengthc[] = {3,  4,  5,  6,  7,  8,  9,   10,  11,  13,
+                                       15, 17, 19, 23, 27, 31, 35,  43,  51,  59,
+                                       67, 83, 99, 115, 131, 163, 195, 227, 258, 259};
+    static unsigned char lengtheb[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                       2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static unsigned short distc[] = {1,    2,    3,    4,    5,    7,     9,     13,
+                                     17,   25,   33,   49,   65,   97,    129,   193,
+                                     257,  385,  513,  769,  1025, 1537,  2049,  3073,
+                                     4097, 6145, 8193, 12289, 16385, 24577, 32768};
+    static unsigned char disteb[] = {0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+                                     6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+    unsigned int bitbuf = 0;
+    int i, j, bitcount = 0;
+    unsigned char* out = NULL;
+    unsigned char*** hash_table =
+        (unsigned char***)STBIW_MALLOC(stbiw__ZHASH * sizeof(unsigned char**));
+    if (hash_table == NULL) return NULL;
+    if (quality < 5) quality = 5;
+
+    stbiw__zlib_add(last ? 1 : 0, 1);  // BFINAL
+    stbiw__zlib_add(1, 2);             // BTYPE = 1 -- fixed huffman
+
+    for (i = 0; i < stbiw__ZHASH; ++i) hash_table[i] = NULL;
+
+    i = 0;
+    while (i < data_len - 3) {
+        int h = stbiw__zhash(data + i) & (stbiw__ZHASH - 1), best = 3;
+        unsigned char* bestloc = 0;
+        unsigned char** hlist = hash_table[h];
+        int n = stbiw__sbcount(hlist);
+        for (j = 0; j < n; ++j) {
+            if (hlist[j] - data > i - 32768) {
+                int d = stbiw__zlib_countm(hlist[j], data + i, data_len - i);
+                if (d >= best) {
+                    best = d;
+                    bestloc = hlist[j];
+                }
+            }
+        }
+        if (hash_table[h] && stbiw__sbn(hash_table[h]) == 2 * quality) {
+            STBIW_MEMMOVE(hash_table[h], hash_table[h] + quality,
+                          sizeof(hash_table[h][0]) * quality);
+            stbiw__sbn(hash_table[h]) = quality;
+        }
+        stbiw__sbpush(hash_table[h], data + i);
+
+        if (bestloc) {
+            h = stbiw__zhash(data + i + 1) & (stbiw__ZHASH - 1);
+            hlist = hash_table[h];
+            n = stbiw__sbcount(hlist);
+            for (j = 0; j < n; ++j) {
+                if (hlist[j] - data > i - 32767) {
+                    int e = stbiw__zlib_countm(hlist[j], data + i + 1, data_len - i - 1);
+                    if (e > best) {
+                        bestloc = NULL;
+                        break;
+                    }
+                }
+            }
+        }
+
+        if (bestloc) {
+            int d = (int)(data + i - bestloc);
+            for (j = 0; best > lengthc[j + 1] - 1; ++j);
+            stbiw__zlib_huff(j + 257);
+            if (lengtheb[j]) stbiw__zlib_add(best - lengthc[j], lengtheb[j]);
+            for (j = 0; d > distc[j + 1] - 1; ++j);
+            stbiw__zlib_add(stbiw__zlib_bitrev(j, 5), 5);
+            if (disteb[j]) stbiw__zlib_add(d - distc[j], disteb[j]);
+            i += best;
+        } else {
+            stbiw__zlib_huffb(data[i]);
+            ++i;
+        }
+    }
+    for (; i < data_len; ++i) stbiw__zlib_huffb(data[i]);
+    stbiw__zlib_huff(256);  // end of block
+    if (!last) stbiw__zlib_add(0, 3);  // empty stored block: BFINAL = 0, BTYPE = 0
+    while (bitcount) stbiw__zlib_add(0, 1);
+    if (!last) {
+        stbiw__sbpush(out, 0x00);  // LEN
+        stbiw__sbpush(out, 0x00);
+        stbiw__sbpush(out, 0xFF);  // NLEN
+        stbiw__sbpush(out, 0xFF);
+    }
+
+    for (i = 0; i < stbiw__ZHASH; ++i) (void)stbiw__sbfree(hash_table[i]);
+    STBIW_FREE(hash_table);
+
+    *out_len = stbiw__sbn(out);
+    STBIW_MEMMOVE(stbiw__sbraw(out), out, *out_len);
+    return (uint8_t*)stbiw__sbraw(out);
+}
+
+#define ADLER_BASE 65521
+
+static uint32_t adler32_update(uint32_t adler, const uint8_t* data, size_t len) {
+    uint32_t s1 = adler & 0xFFFF, s2 = adler >> 16;
+    while (len > 0) {
+        size_t block = len < 5552 ? len : 5552;
+        len -= block;
+        while (block--) {
+            s1 += *data++;
+            s2 += s1;
+        }
+        s1 %= ADLER_BASE;
+        s2 %= ADLER_BASE;
+    }
+    return s1 | (s2 << 16);
+}
+
+// Checksum of the concatenation of two blocks, from the checksums of each (adler2 covers
+// len2 bytes).
+static uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t len2) {
+    const uint32_t rem = len2 % ADLER_BASE;
+    uint32_t sum1 = adler1 & 0xFFFF;
+    uint32_t sum2 = (uint32_t)(((uint64_t)rem * sum1) % ADLER_BASE);
+    sum1 += (adler2 & 0xFFFF) + ADLER_BASE - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + ADLER_BASE - rem;
+    if (sum1 >= ADLER_BASE) sum1 -= ADLER_BASE;
+    if (sum1 >= ADLER_BASE) sum1 -= ADLER_BASE;
+    if (sum2 >= 2 * ADLER_BASE) sum2 -= 2 * ADLER_BASE;
+    if (sum2 >= ADLER_BASE) sum2 -= ADLER_BASE;
+    return sum1 | (sum2 << 16);
+}
+
+// Edge anti-aliasing (--aa NUM): the pixels whose color differs from the color of one of
+// their 4 neighbors by more than AA_THRESHOLD of the colormap get NUM more samples, jittered
+// inside the pixel (stratified when NUM is a square), and are colored with the average color
+// of all their samples.  At most --aa-cap of the pixels, the most contrasted ones, are
+// supersampled (see antialias).
+#define AA_THRESHOLD 0.02
+#define AA_DEFAULT_CAP 0.1
+#define AA_CHUNK 64
+
+struct AaSamples {
+    int per_pixel;    // samples of each supersampled pixel besides its own
+    size_t count;     // supersampled pixels
+    uint64_t* index;  // sorted pixel indices
+    uint32_t* steps;  // per_pixel samples of each supersampled pixel
+};
+
+// Average the colors of the supersampled pixels of row (already colorized in pixels) with
+// the colors of their samples.
+static void antialias_row(const AaSamples* aa, int row, int width, uint32_t smin, uint32_t smax,
+                          const BufferData* palette, BufferData* pixels) {
+    if (aa == NULL) return;
+    const uint64_t first = (uint64_t)row * width;
+    const int total = aa->per_pixel + 1;
+    for (size_t k = std::lower_bound(aa->index, aa->index + aa->count, first) - aa->index;
+         k < aa->count && aa->index[k] < first + width; k++) {
+        BufferData& pixel = pixels[aa->index[k] - first];
+        uint32_t r = pixel.r, g = pixel.g, b = pixel.b, a = pixel.a;
+        for (int n = 0; n < aa->per_pixel; n++) {
+            uint32_t s = aa->steps[k * aa->per_pixel + n];
+            if (s < smin)
+                s = smin;
+            else if (s > smax)
+                s = smax;
+            r += palette[s - smin].r;
+            g += palette[s - smin].g;
+            b += palette[s - smin].b;
+            a += palette[s - smin].a;
+        }
+        pixel.r = (r + total / 2) / total;
+        pixel.g = (g + total / 2) / total;
+        pixel.b = (b + total / 2) / total;
+        pixel.a = (a + total / 2) / total;
+    }
+}
+
+template <typename Sample>
+struct ColorizeRowContext {
+    const Sample* steps;
+    int width;
+    uint32_t smin, smax;
+    const BufferData* palette;
+    const AaSamples* aa;  // (or NULL)
+};
+
+template <typename Sample>
+static void colorize_row(void* p, int row, BufferData* pixels) {
+    ColorizeRowContext<Sample>* data = (ColorizeRowContext<Sample>*)p;
+    colorize(data->steps + (size_t)row * data->width, pixels, data->width, data->smin,
+             data->smax, data->palette);
+    antialias_row(data->aa, row, data->width, data->smin, data->smax, data->palette, pixels);
+}
+
+// Output file name for a colormap variant: the colormap name is inserted before the extension.
+static void variant_filename(char* result, size_t size, const char* filename, const char* name) {
+    const char* ext = strrchr(filename, '.');
+    const char* dir = strrchr(filename, '/');
+    if (ext == NULL || (dir != NULL && ext < dir)) ext = filename + strlen(filename);
+    snprintf(result, size, "%.*s-%s%s", (int)(ext - filename), filename, name, ext);
+}
+
+// Each thread colorizes and encodes whole variants, so that all colormaps can be generated
+// in parallel from a single step buffer.
+template <typename Sample>
+struct GenVariantsData {
+    int thread_id, num_threads;
+    const Sample* steps;
+    int width, height;
+    uint32_t smin, smax;
+    long double log_min, log_delta;
+    const char* filename;
+    const AaSamples* aa;
+    bool success;
+};
+
+template <typename Sample>
+static void* gen_variants(void* p) {
+    GenVariantsData<Sample>* data = (GenVariantsData<Sample>*)p;
+    BufferData* palette = (BufferData*)malloc(sizeof(BufferData) * (data->smax - data->smin + 1));
+    char name[4096];
+    data->success = true;
+    for (int c = data->thread_id; c < (int)COUNT(colormaps); c += data->num_threads) {
+#ifdef DEBUG
+        printf("Thread %d: generating variant %s.\n", data->thread_id, colormap_names[c]);
+        fflush(stdout);
+#endif
+        build_palette(palette, data->smin, data->smax, data->log_min, data->log_delta,
+                      colormaps[c], colormap_sizes[c] / 3 - 1);
+        ColorizeRowContext<Sample> context = {data->steps, data->width, data->smin, data->smax,
+                                              palette,     data->aa};
+        variant_filename(name, sizeof(name), data->filename, colormap_names[c]);
+        if (!write_png(name, data->width, data->height, colorize_row<Sample>, &context, 1)) {
+            fprintf(stderr, "Error: unable to write %s.\n", name);
+            data->success = false;
+        }
+    }
+    free(palette);
+    return NULL;
+}
+
+// Resized outputs (--sizes and --supersample): the colorized samples are averaged over the
+// area of each output pixel (a box filter with fractional coverage at the edges), one output
+// row at a time, so that no full size color image is kept.
+#define MAX_OUTPUTS 16
+
+struct OutputImage {
+    char filename[4096];
+    int width, height;
+};
+
+template <typename Sample>
+struct ResizeRowContext {
+    const Sample* steps;
+    int width, height;  // of the samples
+    int out_width, out_height;
+    uint32_t smin, smax;
+    const BufferData* palette;
+    const AaSamples* aa;
+    // Output pixel (i, j) covers [left + i * scale_x, left + (i + 1) * scale_x) x [top + j *
+    // scale_y, top + (j + 1) * scale_y) of the samples (only the part inside the samples).
+    double left, top, scale_x, scale_y;
+};
+
+template <typename Sample>
+static void resize_row(void* p, int row, BufferData* pixels) {
+    ResizeRowContext<Sample>* data = (ResizeRowContext<Sample>*)p;
+    auto clamp = [](double v, int max) { return v < 0 ? 0 : v > max ? max : v; };
+    const double y0 = clamp(data->top + row * data->scale_y, data->height);
+    const double y1 = clamp(data->top + (row + 1) * data->scale_y, data->height);
+    float* sum = (float*)calloc(4 * data->out_width, sizeof(float));
+    BufferData* line = (BufferData*)malloc(sizeof(BufferData) * data->width);
+    for (int j = (int)y0; j < y1; j++) {
+        const float wy = (j + 1 < y1 ? j + 1 : y1) - (j > y0 ? j : y0);
+        colorize(data->steps + (size_t)j * data->width, line, data->width, data->smin, data->smax,
+                 data->palette);
+        antialias_row(data->aa, j, data->width, data->smin, data->smax, data->palette, line);
+        for (int i = 0; i < data->out_width; i++) {
+            const double x0 = clamp(data->left + i * data->scale_x, data->width);
+            const double x1 = clamp(data->left + (i + 1) * data->scale_x, data->width);
+            for (int k = (int)x0; k < x1; k++) {
+                const float w = wy * ((k + 1 < x1 ? k + 1 : x1) - (k > x0 ? k : x0));
+                sum[4 * i + 0] += w * line[k].r;
+                sum[4 * i + 1] += w * line[k].g;
+                sum[4 * i + 2] += w * line[k].b;
+                sum[4 * i + 3] += w * line[k].a;
+            }
+        }
+    }
+    for (int i = 0; i < data->out_width; i++) {
+        const double x0 = clamp(data->left + i * data->scale_x, data->width);
+        const double x1 = clamp(data->left + (i + 1) * data->scale_x, data->width);
+        const float scale = (x1 - x0) * (y1 - y0) > 0 ? 1 / ((x1 - x0) * (y1 - y0)) : 0;
+        pixels[i].r = (uint8_t)(sum[4 * i + 0] * scale + 0.5f);
+        pixels[i].g = (uint8_t)(sum[4 * i + 1] * scale + 0.5f);
+        pixels[i].b = (uint8_t)(sum[4 * i + 2] * scale + 0.5f);
+        pixels[i].a = (uint8_t)(sum[4 * i + 3] * scale + 0.5f);
+    }
+    free(line);
+    free(sum);
+}
+
+// Each thread resizes and encodes whole outputs, like gen_variants.
+template <typename Sample>
+struct GenOutputsData {
+    int thread_id, num_threads;
+    const OutputImage* outputs;
+    int output_count;
+    int encode_threads;
+    ResizeRowContext<Sample> context;  // without the output size
+    bool success;
+};
+
+template <typename Sample>
+static void* gen_outputs(void* p) {
+    GenOutputsData<Sample>* data = (GenOutputsData<Sample>*)p;
+    data->success = true;
+    for (int k = data->thread_id; k < data->output_count; k += data->num_threads) {
+        const OutputImage& output = data->outputs[k];
+        ResizeRowContext<Sample> context = data->context;
+        context.out_width = output.width;
+        context.out_height = output.height;
+        context.scale_x = (double)context.width / output.width;
+        context.scale_y = (double)context.height / output.height;
+        const bool resize = output.width != context.width || output.height != context.height;
+        ColorizeRowContext<Sample> colorize_context = {
+            context.steps, context.width, context.smin, context.smax, context.palette, context.aa};
+        const bool success =
+            resize ? write_png(output.filename, output.width, output.height,
+                               resize_row<Sample>, &context, data->encode_threads)
+                   : write_png(output.filename, output.width, output.height,
+                               colorize_row<Sample>, &colorize_context, data->encode_threads);
+        if (!success) {
+            fprintf(stderr, "Error: unable to write %s.\n", output.filename);
+            data->success = false;
+        }
+    }
+    return NULL;
+}
+
+// Zoom animation (--zoom FRAMES SCALE): FRAMES frames of the -g size zooming geometrically
+// from the window of -s (or the random one) to a SCALE times smaller window around the same
+// center, saved as FILENAME-0000, FILENAME-0001...  Instead of rendering every frame, key
+// frames are rendered at ZOOM_KEY_SCALE times the frame size, and each frame is resampled
+// from the key frame of the largest window that contains it, which covers all the frames
+// zoomed in up to ZOOM_KEY_SCALE times more.  Only one key frame is kept at a time and the
+// frames are saved in order, each normalized to the samples it covers.
+#define ZOOM_KEY_SCALE 2
+
+struct ZoomAnimation {
+    const char* filename;
+    int frames;
+    long double scale;  // zoom between the first and the last frame
+    int width, height;  // of the frames
+    long double dx;     // half width of the first frame
+    int first, last;    // frames [first, last) of the current key frame
+};
+
+static inline long double zoom_factor(const ZoomAnimation& zoom, int frame) {
+    return zoom.frames > 1 ? powl(zoom.scale, (long double)frame / (zoom.frames - 1)) : 1;
+}
+
+template <typename Sample>
+struct GenFramesData {
+    int thread_id, num_threads;
+    const ZoomAnimation* zoom;
+    const Sample* steps;  // key frame
+    int width, height;
+    long double dx;  // half width of the key frame
+    const AaSamples* aa;
+    int cmap_choice;
+    FrameStream* stream;  // stream to write the frames to instead of files (or NULL)
+    int encode_threads;
+    bool success;
+};
+
+template <typename Sample>
+static void* gen_frames(void* p) {
+    GenFramesData<Sample>* data = (GenFramesData<Sample>*)p;
+    const ZoomAnimation& zoom = *data->zoom;
+    char name[4096];
+    data->success = true;
+    for (int f = zoom.first + data->thread_id; f < zoom.last; f += data->num_threads) {
+        // Samples covered by the frame (pixel k of the key frame covers [k, k + 1)), whose
+        // pixel centers are at the same coordinates as in a direct render.
+        const double ratio = zoom.dx / zoom_factor(zoom, f) / data->dx;
+        const double scale_x = ratio * (data->width - 1) / (zoom.width - 1);
+        const double scale_y = ratio * (data->height - 1) / (zoom.height - 1);
+        const double left = (data->width - scale_x * zoom.width) / 2;
+        const double top = (data->height - scale_y * zoom.height) / 2;
+
+        uint32_t smin = UINT32_MAX;
+        uint32_t smax = 0;
+        const int j1 = std::min(data->height, (int)ceil(top + scale_y * zoom.height));
+        const int i1 = std::min(data->width, (int)ceil(left + scale_x * zoom.width));
+        for (int j = std::max(0, (int)top); j < j1; j++) {
+            for (int i = std::max(0, (int)left); i < i1; i++) {
+                const uint32_t s = data->steps[(size_t)j * data->width + i];
+                if (s < smin) smin = s;
+                if (s > smax) smax = s;
+            }
+        }
+        const long double log_min = log(smin);
+        const long double log_delta = smax > smin ? log(smax) - log_min : 1.0;
+        BufferData* palette = (BufferData*)malloc(sizeof(BufferData) * (smax - smin + 1));
+        build_palette(palette, smin, smax, log_min, log_delta, colormaps[data->cmap_choice],
+                      colormap_sizes[data->cmap_choice] / 3 - 1);
+
+        ResizeRowContext<Sample> context = {
+            data->steps, data->width, data->height, zoom.width, zoom.height, smin,
+            smax,        palette,     data->aa,     left,       top,         scale_x,
+            scale_y};
+        if (data->stream != NULL) {
+            if (!stream_frame(data->stream, f, resize_row<Sample>, &context,
+                              data->encode_threads))
+                data->success = false;
+        } else {
+            char number[16];
+            snprintf(number, sizeof(number), "%04d", f);
+            variant_filename(name, sizeof(name), zoom.filename, number);
+            if (!write_png(name, zoom.width, zoom.height, resize_row<Sample>, &context,
+                           data->encode_threads)) {
+                fprintf(stderr, "Error: unable to write %s.\n", name);
+                data->success = false;
+            }
+        }
+        free(palette);
+    }
+    return NULL;
+}
+
+// Colorize the samples of buffer with a single colormap and write them to filename.
+template <typename Sample>
+static bool save_image(const char* filename, const Sample* buffer, int width, int height,
+                       uint32_t smin, uint32_t smax, long double log_min, long double log_delta,
+                       int cmap_choice, const AaSamples* aa, int num_threads) {
+    BufferData* palette = (BufferData*)malloc(sizeof(BufferData) * (smax - smin + 1));
+    build_palette(palette, smin, smax, log_min, log_delta, colormaps[cmap_choice],
+                  colormap_sizes[cmap_choice] / 3 - 1);
+
+#ifdef DEBUG
+    printf("Saving image %s.\n", filename);
+    fflush(stdout);
+#endif
+
+    ColorizeRowContext<Sample> context = {buffer, width, smin, smax, palette, aa};
+    const bool success =
+        write_png(filename, width, height, colorize_row<Sample>, &context, num_threads);
+    if (!success) fprintf(stderr, "Error: unable to write %s.\n", filename);
+    free(palette);
+    return success;
+}
+
+// Parameters of a render, shared by the sample type specific implementations.
+struct RenderJob {
+    const char* filename;       // PNG output (NULL to skip colorization)
+    const char* dump_filename;  // step dump output (NULL to skip)
+    int width, height;
+    long double x, y, dx, dy;
+    int cmap_choice;
+    bool all_colormaps;
+    int num_threads;
+    void* map;  // mapped step dump to use instead of computing the samples (or NULL)
+    size_t map_size;
+    StepsHeader header;
+    int pan_x, pan_y;             // shift of the window of map in pixels (see pan_samples)
+    bool keep_state;              // save the state of the limited pixels with the dump
+    bool adaptive;                // adapt max_steps to the image (up to its initial value)
+    bool prove;                   // fill tiles proven uniform by interval arithmetic
+    bool progressive;             // compute the samples coarse to fine
+    bool level_images;            // save the coarser progressive levels as images
+    double deadline;              // computation deadline in ms since start (0 for none)
+    uint64_t iter_budget;         // iteration budget of the computation (0 for none)
+    struct timespec start;        // start of the program
+    BufferData* canvas;           // montage cell to colorize into instead of writing filename
+    int canvas_width;             // row stride of canvas
+    const OutputImage* outputs;   // images to write instead of filename (or NULL)
+    int output_count;
+    int aa_samples;               // extra samples of the edge pixels (0 for none)
+    double aa_cap;                // maximal fraction of supersampled pixels
+    const ZoomAnimation* zoom;    // frames to resample instead of writing filename (or NULL)
+    FrameStream* stream;          // stream to write the image to instead of filename (or NULL)
+    bool pipeline;                // overlap computation, colorization and encoding
+    bool norm_set;                // use [norm_min, norm_max] to normalize the samples
+    uint32_t norm_min, norm_max;  // sample range used for colorization
+    struct Preview* preview;      // preview of the window (or NULL)
+    Random rng;
+};
+
+#define PREVIEW_SCALE 8
+
+// A window is rejected by the preview when it shows no variation or when a single sample
+// value covers more than this fraction of the preview.
+#define PREVIEW_MAX_DOMINANT 0.95
+#define PREVIEW_MAX_ATTEMPTS 32
+
+struct Preview {
+    int scale;
+    int rows, cols;
+    uint32_t* steps;  // rows x cols samples
+    uint32_t smin, smax;
+};
+
+struct PreviewData {
+    int thread_id, num_threads;
+    Preview* preview;
+    int width, height;
+    uint32_t smin, smax;
+    long double xmin, xmax, ymin, ymax;
+};
+
+// Low resolution pass over the window: only every scale-th pixel of the full image is
+// computed in each direction (plus the last row and column), so that the preview samples
+// are a subset of the full resolution ones.
+static void* calc_preview(void* p) {
+    PreviewData* data = (PreviewData*)p;
+    Preview* preview = data->preview;
+    for (int r = data->thread_id; r < preview->rows; r += data->num_threads) {
+        const int j = r == preview->rows - 1 ? data->height - 1 : r * preview->scale;
+        const long double y = pixel_coordinate(data->ymin, data->ymax, j, data->height);
+        uint32_t* b = preview->steps + (size_t)r * preview->cols;
+        for (int c = 0; c < preview->cols; c++, b++) {
+            const int i = c == preview->cols - 1 ? data->width - 1 : c * preview->scale;
+            const long double x = pixel_coordinate(data->xmin, data->xmax, i, data->width);
+            const uint32_t steps = 1 + mandelbrot(x, y);
+            *b = steps;
+            if (steps < data->smin) data->smin = steps;
+            if (steps > data->smax) data->smax = steps;
+        }
+    }
+    return NULL;
+}
+
+// Compute a preview of the job window with 1/scale of the full resolution.
+static void compute_preview(const RenderJob& job, int scale, Preview& preview) {
+    preview.scale = scale;
+    preview.rows = (job.height - 1) / scale + 2;
+    preview.cols = (job.width - 1) / scale + 2;
+    preview.steps = (uint32_t*)realloc(preview.steps,
+                                       sizeof(uint32_t) * preview.rows * preview.cols);
+
+    const int num_threads = job.num_threads;
+    pthread_t thread[num_threads];
+    PreviewData pv_data[num_threads];
+    for (int t = 0; t < num_threads; t++) {
+        pv_data[t] = {t,
+                      num_threads,
+                      &preview,
+                      job.width,
+                      job.height,
+                      max_steps + 1,
+                      0,
+                      job.x - job.dx,
+                      job.x + job.dx,
+                      job.y - job.dy,
+                      job.y + job.dy};
+        create_thread(thread + t, calc_preview, (void*)(pv_data + t));
+    }
+    preview.smin = max_steps + 1;
+    preview.smax = 0;
+    for (int t = 0; t < num_threads; t++) {
+        pthread_join(thread[t], NULL);
+        if (pv_data[t].smin < preview.smin) preview.smin = pv_data[t].smin;
+        if (pv_data[t].smax > preview.smax) preview.smax = pv_data[t].smax;
+    }
+}
+
+// Flat windows and windows dominated by a single value (usually the set interior or a
+// uniform escape region) are not worth rendering.
+static bool preview_is_boring(const Preview& preview) {
+    if (preview.smin == preview.smax) return true;
+    const size_t count = (size_t)preview.rows * preview.cols;
+    uint32_t* sorted = (uint32_t*)malloc(sizeof(uint32_t) * count);
+    memcpy(sorted, preview.steps, sizeof(uint32_t) * count);
+    std::sort(sorted, sorted + count);
+    size_t dominant = 0;
+    for (size_t i = 0, j; i < count; i = j) {
+        for (j = i + 1; j < count && sorted[j] == sorted[i]; j++);
+        if (j - i > dominant) dominant = j - i;
+    }
+    free(sorted);
+#ifdef DEBUG
+    printf("Preview: steps %u to %u, dominant value fraction %g.\n", preview.smin, preview.smax,
+           (double)dominant / count);
+#endif
+    return dominant > PREVIEW_MAX_DOMINANT * count;
+}
+
+// Order the bands of rows by decreasing cost, estimated from the iteration counts of the
+// preview rows that cover them.
+static int* preview_band_order(const Preview& preview, int height, int band_lines,
+                               int num_bands) {
+    uint64_t* row_cost = (uint64_t*)calloc(preview.rows, sizeof(uint64_t));
+    for (int r = 0; r < preview.rows; r++) {
+        const uint32_t* b = preview.steps + (size_t)r * preview.cols;
+        for (int c = 0; c < preview.cols; c++) row_cost[r] += b[c];
+    }
+    uint64_t* band_cost = (uint64_t*)calloc(num_bands, sizeof(uint64_t));
+    for (int j = 0; j < height; j++) band_cost[j / band_lines] += row_cost[j / preview.scale];
+    int* order = (int*)malloc(sizeof(int) * num_bands);
+    for (int b = 0; b < num_bands; b++) order[b] = b;
+    std::stable_sort(order, order + num_bands,
+                     [band_cost](int a, int b) { return band_cost[a] > band_cost[b]; });
+    free(band_cost);
+    free(row_cost);
+    return order;
+}
+
+// Pipelined rendering: the image is split in bands of rows that flow independently through
+// computation, colorization, filtering and compression in the worker threads, while the
+// calling thread writes the compressed bands in order.  Only a limited number of bands can
+// be in flight, so memory use does not depend on the image height.  Colors are normalized
+// with a range known in advance (fixed or estimated by a preview).
+#define PIPELINE_BAND_BYTES (1 << 17)
+
+struct PipelineBand {
+    uint8_t* data;  // compressed band, NULL until ready
+    int size;
+    uint32_t adler;
+    size_t raw_size;
+};
+
+struct Pipeline {
+    int width, height;
+    int band_lines, num_bands;
+    long double xmin, xmax, ymin, ymax;
+    uint32_t smin, smax;
+    const BufferData* palette;
+    int quality;
+    int window;  // maximal number of bands in flight
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int next_band;  // next band to compute
+    int written;    // number of bands already written
+    bool failed;    // a band could not be compressed
+    PipelineBand* bands;
+};
+
+static void* pipeline_worker(void* p) {
+    Pipeline* data = (Pipeline*)p;
+    const int width = data->width;
+    const int stride = 4 * width;
+    uint32_t* steps = (uint32_t*)malloc(sizeof(uint32_t) * width);
+    uint8_t* scratch = (uint8_t*)malloc(3 * stride);
+    BufferData* previous = (BufferData*)scratch;
+    BufferData* current = (BufferData*)(scratch + stride);
+    signed char* line = (signed char*)(scratch + 2 * stride);
+    uint8_t* filtered = (uint8_t*)malloc((size_t)(stride + 1) * data->band_lines);
+
+    for (;;) {
+        pthread_mutex_lock(&data->lock);
+        while (data->next_band < data->num_bands &&
+               data->next_band >= data->written + data->window && !data->failed)
+            pthread_cond_wait(&data->changed, &data->lock);
+        const int band = data->next_band;
+        if (band < data->num_bands) data->next_band++;
+        const bool failed = data->failed;
+        pthread_mutex_unlock(&data->lock);
+        if (band >= data->num_bands || failed) break;
+
+        const int start_line = band * data->band_lines;
+        int last_line = start_line + data->band_lines;
+        if (last_line > data->height) last_line = data->height;
+#ifdef DEBUG
+        printf("Band %d: lines %d to %d.\n", band, start_line, last_line - 1);
+        fflush(stdout);
+#endif
+        uint8_t* out = filtered;
+        for (int j = start_line; j < last_line; j++, out += stride + 1) {
+            const long double y = pixel_coordinate(data->ymin, data->ymax, j, data->height);
+            for (int i = 0; i < width && !job_cancelled(); i++) {
+                const long double x = pixel_coordinate(data->xmin, data->xmax, i, width);
+                steps[i] = 1 + mandelbrot(x, y);
+            }
+            // The first row of each band is filtered independently from the previous band.
+            const bool independent = j == start_line;
+            colorize(steps, independent ? previous : current, width, data->smin, data->smax,
+                     data->palette);
+            out[0] = (uint8_t)filter_row(scratch, width, j, independent, line);
+            if (!independent) memcpy(previous, current, stride);
+            memcpy(out + 1, line, stride);
+        }
+
+        PipelineBand result;
+        result.raw_size = (size_t)(stride + 1) * (last_line - start_line);
+        result.adler = adler32_update(1, filtered, result.raw_size);
+        result.data = deflate_band(filtered, (int)result.raw_size, data->quality,
+                                   band == data->num_bands - 1, &result.size);
+
+        pthread_mutex_lock(&data->lock);
+        data->bands[band] = result;
+        if (result.data == NULL) data->failed = true;
+        pthread_cond_broadcast(&data->changed);
+        pthread_mutex_unlock(&data->lock);
+    }
+
+    free(filtered);
+    free(scratch);
+    free(steps);
+    return NULL;
+}
+
+static int render_pipeline(RenderJob& job) {
+    const int wid = job.width;
+    const int hei = job.height;
+    const int num_threads = job.num_threads;
+
+    uint32_t smin, smax;
+    if (job.norm_set) {
+        smin = job.norm_min;
+        smax = job.norm_max;
+    } else {
+        Preview preview = {};
+        if (job.preview == NULL) compute_preview(job, PREVIEW_SCALE, preview);
+        smin = job.preview ? job.preview->smin : preview.smin;
+        smax = job.preview ? job.preview->smax : preview.smax;
+        free(preview.steps);
+#ifdef DEBUG
+        printf("Preview range: %u to %u.\n", smin, smax);
+#endif
+    }
+
+    const long double log_min = log(smin);
+    const long double log_max = log(smax);
+    long double log_delta;
+    if (log_max > log_min) {
+        log_delta = log_max - log_min;
+    } else {
+        log_delta = 1.0;
+        printf("WARNING: Selected window contains no detectable variation.\n");
+        fflush(stdout);
+    }
+
+    int cmap_choice = job.cmap_choice;
+    if (cmap_choice < 0) cmap_choice = random_next(job.rng) % COUNT(colormaps);
+#ifdef DEBUG
+    printf("Using colormap %d.\n", cmap_choice);
+#endif
+    BufferData* palette = (BufferData*)malloc(sizeof(BufferData) * (smax - smin + 1));
+    build_palette(palette, smin, smax, log_min, log_delta, colormaps[cmap_choice],
+                  colormap_sizes[cmap_choice] / 3 - 1);
+
+    FILE* out = open_output(job.filename);
+    if (out == NULL) {
+        fprintf(stderr, "Error: unable to write %s.\n", job.filename);
+        free(palette);
+        return 1;
+    }
+
+    Pipeline pipeline;
+    pipeline.width = wid;
+    pipeline.height = hei;
+    pipeline.band_lines = PIPELINE_BAND_BYTES / (4 * wid + 1) + 1;
+    pipeline.num_bands = (hei + pipeline.band_lines - 1) / pipeline.band_lines;
+    pipeline.xmin = job.x - job.dx;
+    pipeline.xmax = job.x + job.dx;
+    pipeline.ymin = job.y - job.dy;
+    pipeline.ymax = job.y + job.dy;
+    pipeline.smin = smin;
+    pipeline.smax = smax;
+    pipeline.palette = palette;
+    pipeline.quality = stbi_write_png_compression_level;
+    pipeline.window = 2 * num_threads;
+    pthread_mutex_init(&pipeline.lock, NULL);
+    pthread_cond_init(&pipeline.changed, NULL);
+    pipeline.next_band = 0;
+    pipeline.written = 0;
+    pipeline.failed = false;
+    pipeline.bands = (PipelineBand*)calloc(pipeline.num_bands, sizeof(PipelineBand));
+
+    pthread_t thread[num_threads];
+    for (int t = 0; t < num_threads; t++)
+        create_thread(thread + t, pipeline_worker, (void*)&pipeline);
+
+    // The zlib header and the final checksum go in their own chunks around the bands.
+    static const uint8_t zlib_header[2] = {0x78, 0x5E};
+    bool success = write_png_header(out, wid, hei) &&
+                   write_png_chunk(out, "IDAT", zlib_header, sizeof(zlib_header));
+    uint32_t adler = 1;
+    for (int b = 0; b < pipeline.num_bands; b++) {
+        pthread_mutex_lock(&pipeline.lock);
+        while (pipeline.bands[b].data == NULL && !pipeline.failed)
+            pthread_cond_wait(&pipeline.changed, &pipeline.lock);
+        PipelineBand band = pipeline.bands[b];
+        pthread_mutex_unlock(&pipeline.lock);
+        if (band.data == NULL) {
+            success = false;
+            break;
+        }
+
+        success = success && write_png_chunk(out, "IDAT", band.data, band.size);
+        adler = adler32_combine(adler, band.adler, band.raw_size);
+        STBIW_FREE(band.data);
+
+        pthread_mutex_lock(&pipeline.lock);
+        pipeline.written++;
+        pthread_cond_broadcast(&pipeline.changed);
+        pthread_mutex_unlock(&pipeline.lock);
+    }
+    const uint8_t trailer[4] = {uint8_t(adler >> 24), uint8_t(adler >> 16), uint8_t(adler >> 8),
+                                uint8_t(adler)};
+    success = success && write_png_chunk(out, "IDAT", trailer, 4) &&
+              write_png_chunk(out, "IEND", NULL, 0);
+
+    for (int t = 0; t < num_threads; t++) pthread_join(thread[t], NULL);
+    // Bands compressed after a failure are not written.
+    for (int b = pipeline.written; b < pipeline.num_bands; b++) STBIW_FREE(pipeline.bands[b].data);
+    success = (fclose(out) == 0) && success;
+    if (pipeline.failed) fprintf(stderr, "Error: unable to compress %s.\n", job.filename);
+    if (!success) fprintf(stderr, "Error: unable to write %s.\n", job.filename);
+
+    pthread_cond_destroy(&pipeline.changed);
+    pthread_mutex_destroy(&pipeline.lock);
+    free(pipeline.bands);
+    free(palette);
+    return success ? 0 : 1;
+}
+
+// Limited pixels (which did not escape within the limit in use when they were computed) are
+// continued up to max_steps by the continue_states threads, from the z of their state and the
+// number of iterations given by their sample, in chunks of CONTINUE_CHUNK pixels.
+#define CONTINUE_CHUNK 256
+
+template <typename Sample>
+struct ContinueData {
+    int thread_id;
+    Sample* buffer;
+    StepState* states;  // updated in place
+    size_t count;
+    std::atomic<size_t>* next;
+    int width, height;
+    long double xmin, xmax, ymin, ymax;
+};
+
+template <typename Sample>
+static void* continue_states(void* p) {
+    ContinueData<Sample>* data = (ContinueData<Sample>*)p;
+    const size_t size = (size_t)data->width * data->height;
+    for (size_t first = data->next->fetch_add(CONTINUE_CHUNK); first < data->count;
+         first = data->next->fetch_add(CONTINUE_CHUNK)) {
+        const size_t last =
+            data->count - first > CONTINUE_CHUNK ? first + CONTINUE_CHUNK : data->count;
+        for (size_t k = first; k < last && !job_cancelled(); k++) {
+            StepState& state = data->states[k];
+            if (state.index >= size) continue;
+            const long double x = pixel_coordinate(data->xmin, data->xmax,
+                                                   state.index % data->width, data->width);
+            const long double y = pixel_coordinate(data->ymin, data->ymax,
+                                                   state.index / data->width, data->height);
+            long double zr = join_coordinate(state.r);
+            long double zi = join_coordinate(state.i);
+            const uint32_t start = data->buffer[state.index] - 1;
+            data->buffer[state.index] = (Sample)(1 + iterate(x, y, zr, zi, start, max_steps));
+            split_coordinate(zr, state.r);
+            split_coordinate(zi, state.i);
+        }
+    }
+    return NULL;
+}
+
+template <typename Sample>
+static void continue_pixels(const RenderJob& job, Sample* buffer, StepState* states,
+                            size_t count, int num_threads) {
+    std::atomic<size_t> next(0);
+    pthread_t thread[num_threads];
+    ContinueData<Sample> cs_data[num_threads];
+    for (int t = 0; t < num_threads; t++) {
+        cs_data[t] = {t,
+                      buffer,
+                      states,
+                      count,
+                      &next,
+                      job.width,
+                      job.height,
+                      job.x - job.dx,
+                      job.x + job.dx,
+                      job.y - job.dy,
+                      job.y + job.dy};
+        create_thread(thread + t, continue_states<Sample>, (void*)(cs_data + t));
+    }
+    for (int t = 0; t < num_threads; t++) pthread_join(thread[t], NULL);
+}
+
+template <typename Sample>
+static void sample_range(const Sample* buffer, size_t size, uint32_t& smin, uint32_t& smax) {
+    smin = max_steps + 1;
+    smax = 0;
+    for (size_t k = 0; k < size; k++) {
+        if (buffer[k] < smin) smin = buffer[k];
+        if (buffer[k] > smax) smax = buffer[k];
+    }
+}
+
+// Fill buffer with the samples of the mapped dump of job and continue its limited pixels up
+// to max_steps, from their saved state or from the start for pixels without one.  Returns the
+// range of the samples and, if job.keep_state, the states of the pixels still limited (sorted
+// by index).
+template <typename Sample, typename Stored>
+static void resume_samples(const RenderJob& job, Sample* buffer, int num_threads,
+                           uint32_t& smin, uint32_t& smax, StepState*& states,
+                           size_t& state_count) {
+    const StepsHeader& header = job.header;
+    const Stored* stored = (const Stored*)((const uint8_t*)job.map + header.header_size);
+    const StepState* saved =
+        (const StepState*)((const uint8_t*)job.map + steps_state_offset(header));
+    const size_t size = (size_t)job.width * job.height;
+    size_t state_capacity = 0;
+    size_t num_saved = 0;
+    state_count = 0;
+    for (size_t k = 0, s = 0; k < size; k++) {
+        buffer[k] = (Sample)stored[k];
+        if (stored[k] <= header.max_steps) continue;
+        while (s < header.state_count && saved[s].index < k) s++;
+        if (s < header.state_count && saved[s].index == k) {
+            add_state(states, state_count, state_capacity, k, 0, 0);
+            states[state_count - 1] = saved[s];
+            num_saved++;
+        } else {
+            buffer[k] = 1;  // restart from z = c
+            add_state(states, state_count, state_capacity, k,
+                      pixel_coordinate(job.x - job.dx, job.x + job.dx, k % job.width,
+                                       job.width),
+                      pixel_coordinate(job.y - job.dy, job.y + job.dy, k / job.width,
+                                       job.height));
+        }
+    }
+
+    continue_pixels(job, buffer, states, state_count, num_threads);
+    sample_range(buffer, size, smin, smax);
+#ifdef DEBUG
+    printf("Resumed %zu pixels (%zu from saved state) from %u to %u iterations.\n",
+           state_count, num_saved, header.max_steps, max_steps);
+#endif
+
+    size_t kept = 0;
+    if (job.keep_state)
+        for (size_t k = 0; k < state_count; k++)
+            if (buffer[states[k].index] > max_steps) states[kept++] = states[k];
+    state_count = kept;
+}
+
+// Incremental pan (--pan DX DY with -l): the window of the dump is shifted by whole pixels,
+// so the samples of the overlap are moved as they are (with the states of their limited
+// pixels) and only the exposed rows and columns are computed.
+template <typename Sample>
+struct PanData {
+    CalcBufferData<Sample> calc;
+    int first_row, last_row;        // rows with retained samples
+    int first_column, last_column;  // retained columns of these rows
+};
+
+template <typename Sample>
+static void* calc_exposed(void* p) {
+    PanData<Sample>* data = (PanData<Sample>*)p;
+    CalcBufferData<Sample>* calc = &data->calc;
+    BandSchedule* schedule = calc->schedule;
+    for (int k = schedule->next++; k < schedule->num_bands && !job_cancelled();
+         k = schedule->next++) {
+        const int start_line = k * schedule->band_lines;
+        const int last_line = std::min(start_line + schedule->band_lines, calc->height);
+        for (int j = start_line; j < last_line; j++) {
+            if (j < data->first_row || j >= data->last_row) {
+                calc_pixels(calc, j, j + 1, 0, calc->width);
+            } else {
+                calc_pixels(calc, j, j + 1, 0, data->first_column);
+                calc_pixels(calc, j, j + 1, data->last_column, calc->width);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Fill buffer with the samples of the mapped dump of job moved by (job.pan_x, job.pan_y) and
+// compute the exposed pixels in the window of job.  Returns the range of the samples and, if
+// keep_state, the states of the limited pixels (sorted by index).
+template <typename Sample, typename Stored>
+static void pan_samples(const RenderJob& job, Sample* buffer, int num_threads, bool keep_state,
+                        uint32_t& smin, uint32_t& smax, StepState*& states,
+                        size_t& state_count) {
+    const StepsHeader& header = job.header;
+    const Stored* stored = (const Stored*)((const uint8_t*)job.map + header.header_size);
+    const StepState* saved =
+        (const StepState*)((const uint8_t*)job.map + steps_state_offset(header));
+    const int wid = job.width;
+    const int hei = job.height;
+    int first_row = std::max(0, -job.pan_y);
+    int last_row = std::min(hei, hei - job.pan_y);
+    const int first_column = std::max(0, -job.pan_x);
+    const int last_column = std::min(wid, wid - job.pan_x);
+    if (first_row >= last_row || first_column >= last_column) first_row = last_row = 0;
+
+    size_t state_capacity = 0;
+    state_count = 0;
+    smin = max_steps + 1;
+    smax = 0;
+    size_t s = 0;
+    for (int j = first_row; j < last_row; j++) {
+        for (int i = first_column; i < last_column; i++) {
+            const size_t k = (size_t)(j + job.pan_y) * wid + (i + job.pan_x);
+            const uint32_t sample = stored[k];
+            buffer[(size_t)j * wid + i] = (Sample)sample;
+            if (sample < smin) smin = sample;
+            if (sample > smax) smax = sample;
+            if (!keep_state || sample <= header.max_steps) continue;
+            while (s < header.state_count && saved[s].index < k) s++;
+            if (s < header.state_count && saved[s].index == k) {
+                add_state(states, state_count, state_capacity, 0, 0, 0);
+                states[state_count - 1] = saved[s];
+                states[state_count - 1].index = (uint64_t)j * wid + i;
+            }
+        }
+    }
+
+    BandSchedule schedule;
+    schedule.band_lines = CALC_BAND_LINES;
+    schedule.num_bands = (hei + CALC_BAND_LINES - 1) / CALC_BAND_LINES;
+    schedule.order = NULL;
+    schedule.next = 0;
+    pthread_t thread[num_threads];
+    PanData<Sample> pan_data[num_threads];
+    for (int t = 0; t < num_threads; t++) {
+        pan_data[t] = {{t,
+                        buffer,
+                        &schedule,
+                        wid,
+                        hei,
+                        smin,
+                        smax,
+                        job.x - job.dx,
+                        job.x + job.dx,
+                        job.y - job.dy,
+                        job.y + job.dy,
+                        NULL,
+                        keep_state,
+                        NULL,
+                        0,
+                        0,
+                        false,
+                        0,
+                        0,
+                        0,
+                        1},
+                       first_row,
+                       last_row,
+                       first_column,
+                       last_column};
+        create_thread(thread + t, calc_exposed<Sample>, (void*)(pan_data + t));
+    }
+    for (int t = 0; t < num_threads; t++) {
+        pthread_join(thread[t], NULL);
+        CalcBufferData<Sample>& calc = pan_data[t].calc;
+        if (calc.smin < smin) smin = calc.smin;
+        if (calc.smax > smax) smax = calc.smax;
+        if (calc.state_count > 0) {
+            states = (StepState*)realloc(states,
+                                         sizeof(StepState) * (state_count + calc.state_count));
+            memcpy(states + state_count, calc.states, sizeof(StepState) * calc.state_count);
+            state_count += calc.state_count;
+        }
+        free(calc.states);
+    }
+    std::sort(states, states + state_count,
+              [](const StepState& a, const StepState& b) { return a.index < b.index; });
+
+    const size_t size = (size_t)wid * hei;
+    const size_t retained = (size_t)(last_row - first_row) * (last_column - first_column);
+    fprintf(stderr, "Pan: %zu of %zu pixels computed.\n", size - retained, size);
+}
+
+// Adaptive iteration limit (--adaptive): the samples are first computed with at most
+// ADAPTIVE_START_STEPS iterations, then the limit is doubled, up to the -z MAX, and the
+// limited pixels reachable from the escaped pixels (or from the image border) are continued
+// from their state, as a flood fill that stops at the pixels that stay limited.  This ends
+// when fewer than ADAPTIVE_TOLERANCE of the continued pixels escape with the new limit.  The
+// remaining limited pixels are then considered interior at the final limit, which becomes
+// max_steps.
+#define ADAPTIVE_START_STEPS 256
+#define ADAPTIVE_TOLERANCE 0.02
+#define NO_SLOT UINT32_MAX
+
+template <typename Sample>
+static void adapt_limit(const RenderJob& job, Sample* buffer, uint32_t limit, int num_threads,
+                        StepState*& states, size_t& state_count) {
+    const int wid = job.width;
+    const int hei = job.height;
+    const size_t size = (size_t)wid * hei;
+    // slot[p] is the index of the state of pixel p, or NO_SLOT once p escaped.
+    uint32_t* slot = (uint32_t*)malloc(sizeof(uint32_t) * size);
+    uint8_t* queued = (uint8_t*)calloc(size, 1);
+    StepState* work = (StepState*)malloc(sizeof(StepState) * (state_count + 1));
+    StepState* next = (StepState*)malloc(sizeof(StepState) * (state_count + 1));
+    for (size_t p = 0; p < size; p++) slot[p] = NO_SLOT;
+    for (size_t k = 0; k < state_count; k++) slot[states[k].index] = k;
+
+    auto pending = [&](size_t p) {
+        return slot[p] != NO_SLOT && !queued[p] && buffer[p] <= max_steps;
+    };
+    auto exposed = [&](size_t p) {
+        const int i = p % wid;
+        const int j = p / wid;
+        return i == 0 || i == wid - 1 || j == 0 || j == hei - 1 || slot[p - 1] == NO_SLOT ||
+               slot[p + 1] == NO_SLOT || slot[p - wid] == NO_SLOT || slot[p + wid] == NO_SLOT;
+    };
+
+    int rounds = 0;
+    size_t total = 0;
+    while (max_steps < limit) {
+        max_steps = max_steps <= limit / 2 ? 2 * max_steps : limit;
+        size_t n = 0;
+        for (size_t k = 0; k < state_count; k++) {
+            const size_t p = states[k].index;
+            if (!pending(p) || !exposed(p)) continue;
+            queued[p] = 1;
+            work[n++] = states[k];
+        }
+
+        size_t continued = 0;
+        size_t escaped = 0;
+        while (n > 0) {
+            continue_pixels(job, buffer, work, n, num_threads);
+            for (size_t k = 0; k < n; k++) {
+                const size_t p = work[k].index;
+                queued[p] = 0;
+                states[slot[p]] = work[k];
+                if (buffer[p] > max_steps) continue;
+                slot[p] = NO_SLOT;
+                escaped++;
+            }
+            continued += n;
+
+            // Continue the limited neighbors of the pixels that escaped.
+            size_t m = 0;
+            for (size_t k = 0; k < n; k++) {
+                const size_t p = work[k].index;
+                if (slot[p] != NO_SLOT) continue;
+                const int i = p % wid;
+                const int j = p / wid;
+                const size_t neighbors[4] = {i > 0 ? p - 1 : p, i < wid - 1 ? p + 1 : p,
+                                             j > 0 ? p - wid : p, j < hei - 1 ? p + wid : p};
+                for (size_t q : neighbors) {
+                    if (!pending(q)) continue;
+                    queued[q] = 1;
+                    next[m++] = states[slot[q]];
+                }
+            }
+            std::swap(work, next);
+            n = m;
+        }
+
+        size_t kept = 0;
+        for (size_t k = 0; k < state_count; k++) {
+            if (slot[states[k].index] == NO_SLOT) continue;
+            slot[states[k].index] = kept;
+            states[kept++] = states[k];
+        }
+        state_count = kept;
+        rounds++;
+        total += continued;
+#ifdef DEBUG
+        printf("Adaptive limit %u: %zu of %zu continued pixels escaped.\n", max_steps, escaped,
+               continued);
+#endif
+        if (escaped < ADAPTIVE_TOLERANCE * continued) break;
+    }
+    free(slot);
+    free(queued);
+    free(work);
+    free(next);
+
+    // Pixels left behind by the last rounds become interior at the final limit (their state
+    // is not valid for it any more).
+    size_t kept = 0;
+    for (size_t k = 0; k < state_count; k++) {
+        Sample& sample = buffer[states[k].index];
+        if (sample == max_steps + 1) {
+            states[kept++] = states[k];
+        } else {
+            sample = max_steps + 1;
+        }
+    }
+    state_count = kept;
+    fprintf(stderr, "Adaptive iteration limit: %u (%d rounds, %zu pixels continued).\n",
+            max_steps, rounds, total);
+}
+
+struct AntialiasData {
+    const AaSamples* aa;
+    std::atomic<size_t>* next;
+    uint64_t seed;
+    int width, height;
+    long double xmin, xmax, ymin, ymax;
+};
+
+static void* antialias_pixels(void* p) {
+    AntialiasData* data = (AntialiasData*)p;
+    const AaSamples& aa = *data->aa;
+    const int grid = (int)sqrt(aa.per_pixel);
+    const bool stratified = grid * grid == aa.per_pixel;
+    const long double px = data->width > 1 ? (data->xmax - data->xmin) / (data->width - 1) : 0;
+    const long double py = data->height > 1 ? (data->ymax - data->ymin) / (data->height - 1) : 0;
+    for (size_t first = data->next->fetch_add(AA_CHUNK); first < aa.count;
+         first = data->next->fetch_add(AA_CHUNK)) {
+        const size_t last = aa.count - first > AA_CHUNK ? first + AA_CHUNK : aa.count;
+        for (size_t k = first; k < last && !job_cancelled(); k++) {
+            const int i = aa.index[k] % data->width;
+            const int j = aa.index[k] / data->width;
+            const long double x = pixel_coordinate(data->xmin, data->xmax, i, data->width);
+            const long double y = pixel_coordinate(data->ymin, data->ymax, j, data->height);
+            // The jitter of each pixel only depends on its index.
+            Random rng = {random_bits(data->seed, aa.index[k]), 0};
+            for (int n = 0; n < aa.per_pixel; n++) {
+                long double u = random_unit(rng.seed, rng.counter++);
+                long double v = random_unit(rng.seed, rng.counter++);
+                if (stratified) {
+                    u = (n % grid + u) / grid;
+                    v = (n / grid + v) / grid;
+                }
+                aa.steps[k * aa.per_pixel + n] =
+                    1 + mandelbrot(x + (u - 0.5L) * px, y + (v - 0.5L) * py);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Select the edge pixels of buffer and compute their samples for --aa.
+template <typename Sample>
+static void antialias(RenderJob& job, const Sample* buffer, uint32_t smin, uint32_t smax,
+                      int num_threads, AaSamples& aa) {
+    const int wid = job.width;
+    const int hei = job.height;
+    const long double log_min = log(smin);
+    const long double log_delta = smax > smin ? log(smax) - log_min : 1.0;
+    float* level = (float*)malloc(sizeof(float) * (smax - smin + 1));
+    for (uint32_t s = smin; s <= smax; s++) level[s - smin] = (log(s) - log_min) / log_delta;
+    auto level_of = [&](Sample s) { return level[(s < smin ? smin : s > smax ? smax : s) - smin]; };
+
+    struct Edge {
+        float contrast;
+        uint64_t index;
+    };
+    size_t capacity = (size_t)wid * hei / 16 + 1;
+    Edge* edges = (Edge*)malloc(sizeof(Edge) * capacity);
+    size_t count = 0;
+    for (int j = 0; j < hei; j++) {
+        for (int i = 0; i < wid; i++) {
+            const size_t index = (size_t)j * wid + i;
+            const float l = level_of(buffer[index]);
+            float contrast = 0;
+            if (i > 0) contrast = std::max(contrast, fabsf(l - level_of(buffer[index - 1])));
+            if (i + 1 < wid) contrast = std::max(contrast, fabsf(l - level_of(buffer[index + 1])));
+            if (j > 0) contrast = std::max(contrast, fabsf(l - level_of(buffer[index - wid])));
+            if (j + 1 < hei)
+                contrast = std::max(contrast, fabsf(l - level_of(buffer[index + wid])));
+            if (contrast <= AA_THRESHOLD) continue;
+            if (count == capacity) {
+                capacity *= 2;
+                edges = (Edge*)realloc(edges, sizeof(Edge) * capacity);
+            }
+            edges[count++] = {contrast, index};
+        }
+    }
+    free(level);
+
+    const size_t cap = (size_t)(job.aa_cap * wid * hei);
+    if (count > cap) {
+        std::nth_element(edges, edges + cap, edges + count,
+                         [](const Edge& a, const Edge& b) { return a.contrast > b.contrast; });
+        count = cap;
+    }
+    aa.per_pixel = job.aa_samples;
+    aa.count = count;
+    aa.index = (uint64_t*)malloc(sizeof(uint64_t) * count);
+    for (size_t k = 0; k < count; k++) aa.index[k] = edges[k].index;
+    free(edges);
+    std::sort(aa.index, aa.index + count);
+    aa.steps = (uint32_t*)malloc(sizeof(uint32_t) * count * aa.per_pixel);
+
+    std::atomic<size_t> next(0);
+    AntialiasData data = {&aa,           &next,         random_next(job.rng),
+                          wid,           hei,           job.x - job.dx,
+                          job.x + job.dx, job.y - job.dy, job.y + job.dy};
+    pthread_t thread[num_threads];
+    for (int t = 0; t < num_threads; t++) create_thread(thread + t, antialias_pixels, &data);
+    for (int t = 0; t < num_threads; t++) pthread_join(thread[t], NULL);
+
+    fprintf(stderr, "Anti-aliasing: %zu edge pixels, %zu extra samples.\n", count,
+            count * aa.per_pixel);
+}
+
+// Progressive rendering (--progressive): the samples are computed in PROGRESSIVE_LEVELS levels
+// of decreasing pixel spacing (every 4th pixel of every 4th row, then every 2nd, then all),
+// each level computing only the pixels missing from the coarser ones.  Within a level, the
+// threads process tiles of PROGRESSIVE_TILE pixels from the center of the image outward.  With
+// --progressive-images, the samples of the coarser levels are also saved as images named
+// FILENAME-1of16 and FILENAME-1of4.  The coarser levels also compute their pixels on mirrored
+// rows (see mirror_rows), without saving their state, so that they are complete; these rows are
+// copied from the rows they mirror after the last level as usual.
+#define PROGRESSIVE_LEVELS 3
+#define PROGRESSIVE_TILE 64
+
+// Budgeted rendering (--deadline and --iter-budget): the samples are computed progressively
+// and the budget is checked before each pixel (so that it is exceeded by at most one pixel
+// per thread).  Once the time since the start of the
+// program or the iterations of the computation exceed it, the rows of the first level are
+// computed with at most DEADLINE_STEPS iterations (their limited pixels are taken as inside
+// the set) and the rows of the finer levels are filled with the samples of the coarser ones,
+// so that the computation finishes at once and an image is always produced.
+#define DEADLINE_STEPS 256
+
+struct ProgressiveTiles {
+    BandSchedule schedule;  // one "band" per tile, first so calc_level can get the tiles back
+    int columns;
+    bool budgeted;
+    const struct timespec* start;
+    double deadline;       // in ms since start (0 for none)
+    uint64_t iter_budget;  // (0 for none)
+    uint32_t limit;        // iteration limit of the first level once over budget
+    std::atomic<uint64_t> iterations;           // at the full limit, counted in the budget
+    std::atomic<uint64_t> degraded_iterations;  // at the DEADLINE_STEPS limit
+    std::atomic<bool> exhausted;
+    std::atomic<int> limited_tiles, filled_tiles;
+};
+
+static bool over_budget(ProgressiveTiles* tiles) {
+    if (tiles->exhausted) return true;
+    if ((tiles->iter_budget > 0 && tiles->iterations >= tiles->iter_budget) ||
+        (tiles->deadline > 0 && elapsed_ms(*tiles->start) >= tiles->deadline))
+        tiles->exhausted = true;
+    return tiles->exhausted;
+}
+
+template <typename Sample>
+static void* calc_level(void* p) {
+    CalcBufferData<Sample>* data = (CalcBufferData<Sample>*)p;
+    ProgressiveTiles* tiles = (ProgressiveTiles*)data->schedule;
+    BandSchedule* schedule = data->schedule;
+    const int stride = data->stride;
+    const bool first_level = stride == 1 << (PROGRESSIVE_LEVELS - 1);
+    for (int k = schedule->next++; k < schedule->num_bands && !job_cancelled();
+         k = schedule->next++) {
+        const int tile = schedule->order[k];
+        const int i0 = tile % tiles->columns * PROGRESSIVE_TILE;
+        const int j0 = tile / tiles->columns * PROGRESSIVE_TILE;
+        const int i1 = i0 + PROGRESSIVE_TILE < data->width ? i0 + PROGRESSIVE_TILE : data->width;
+        const int j1 = j0 + PROGRESSIVE_TILE < data->height ? j0 + PROGRESSIVE_TILE : data->height;
+        bool degraded = false;
+        for (int j = j0; j < j1; j += stride) {
+            const bool mirrored = data->mirror != NULL && data->mirror[j] >= 0;
+            if (mirrored && stride == 1) continue;
+            const long double y = pixel_coordinate(data->ymin, data->ymax, j, data->height);
+            // Pixels on even rows and columns of the level belong to the coarser level.
+            const int skip = !first_level && j % (2 * stride) == 0 ? 2 * stride : 0;
+            Sample* row = data->buffer + (size_t)j * data->width;
+            for (int i = i0; i < i1 && !job_cancelled(); i += stride) {
+                if (skip > 0 && i % skip == 0) continue;
+                const long double x = pixel_coordinate(data->xmin, data->xmax, i, data->width);
+                if (!tiles->budgeted || !over_budget(tiles)) {
+                    calc_pixel(data, row + i, x, y, data->keep_state && !mirrored);
+                    if (tiles->budgeted) tiles->iterations += row[i] - 1;
+                } else if (first_level) {
+                    long double zr = x;
+                    long double zi = y;
+                    uint32_t steps = 1 + iterate(x, y, zr, zi, 0, tiles->limit);
+                    tiles->degraded_iterations += steps - 1;
+                    if (steps > tiles->limit) steps = max_steps + 1;
+                    row[i] = (Sample)steps;
+                    if (steps < data->smin) data->smin = steps;
+                    if (steps > data->smax) data->smax = steps;
+                    degraded = true;
+                } else {
+                    // Nearest sample of the coarser level.
+                    const int coarse = 2 * stride;
+                    row[i] = data->buffer[(size_t)(j - j % coarse) * data->width + i - i % coarse];
+                    degraded = true;
+                }
+            }
+        }
+        if (degraded) (first_level ? tiles->limited_tiles : tiles->filled_tiles)++;
+    }
+    return NULL;
+}
+
+// Compute the samples of job level by level with the calc_level threads, using cb_data as
+// initialized for calc_buffer.
+template <typename Sample>
+static bool calc_levels(const RenderJob& job, Sample* buffer, CalcBufferData<Sample>* cb_data,
+                        int num_threads) {
+    const int wid = job.width;
+    const int hei = job.height;
+    ProgressiveTiles tiles;
+    tiles.columns = (wid + PROGRESSIVE_TILE - 1) / PROGRESSIVE_TILE;
+    tiles.budgeted = job.deadline > 0 || job.iter_budget > 0;
+    tiles.start = &job.start;
+    tiles.deadline = job.deadline;
+    tiles.iter_budget = job.iter_budget;
+    tiles.limit = max_steps < DEADLINE_STEPS ? max_steps : DEADLINE_STEPS;
+    tiles.iterations = 0;
+    tiles.degraded_iterations = 0;
+    tiles.exhausted = false;
+    tiles.limited_tiles = 0;
+    tiles.filled_tiles = 0;
+    const int rows = (hei + PROGRESSIVE_TILE - 1) / PROGRESSIVE_TILE;
+    int* order = (int*)malloc(sizeof(int) * tiles.columns * rows);
+    for (int k = 0; k < tiles.columns * rows; k++) order[k] = k;
+    auto distance = [&](int tile) {
+        const long dx = 2L * (tile % tiles.columns) * PROGRESSIVE_TILE + PROGRESSIVE_TILE - wid;
+        const long dy = 2L * (tile / tiles.columns) * PROGRESSIVE_TILE + PROGRESSIVE_TILE - hei;
+        return dx * dx + dy * dy;
+    };
+    std::stable_sort(order, order + tiles.columns * rows,
+                     [&](int a, int b) { return distance(a) < distance(b); });
+    tiles.schedule.band_lines = PROGRESSIVE_TILE;
+    tiles.schedule.num_bands = tiles.columns * rows;
+    tiles.schedule.order = order;
+
+    bool success = true;
+    pthread_t thread[num_threads];
+    for (int level = 0; level < PROGRESSIVE_LEVELS; level++) {
+        const int stride = 1 << (PROGRESSIVE_LEVELS - 1 - level);
+        tiles.schedule.next = 0;
+        for (int t = 0; t < num_threads; t++) {
+            cb_data[t].schedule = &tiles.schedule;
+            cb_data[t].stride = stride;
+            create_thread(thread + t, calc_level<Sample>, (void*)(cb_data + t));
+        }
+        for (int t = 0; t < num_threads; t++) pthread_join(thread[t], NULL);
+        if (job_cancelled()) break;
+        if (stride == 1 || !job.level_images || job.filename == NULL) continue;
+
+        // Image of the level, from the samples computed so far.
+        const int level_wid = (wid + stride - 1) / stride;
+        const int level_hei = (hei + stride - 1) / stride;
+        Sample* level_buffer = (Sample*)malloc(sizeof(Sample) * level_wid * level_hei);
+        uint32_t smin = max_steps + 1;
+        uint32_t smax = 0;
+        for (int j = 0; j < level_hei; j++) {
+            for (int i = 0; i < level_wid; i++) {
+                const Sample sample = buffer[(size_t)j * stride * wid + i * stride];
+                level_buffer[(size_t)j * level_wid + i] = sample;
+                if (sample < smin) smin = sample;
+                if (sample > smax) smax = sample;
+            }
+        }
+        const long double log_min = log(smin);
+        const long double log_delta = smax > smin ? log(smax) - log_min : 1.0;
+        char name[4096];
+        variant_filename(name, sizeof(name), job.filename, stride == 4 ? "1of16" : "1of4");
+        if (!save_image(name, level_buffer, level_wid, level_hei, smin, smax, log_min,
+                        log_delta, job.cmap_choice, NULL, num_threads))
+            success = false;
+        free(level_buffer);
+    }
+    if (tiles.budgeted) {
+        fprintf(stderr, "Budget: %llu iterations in %g ms", (unsigned long long)tiles.iterations,
+                elapsed_ms(job.start));
+        if (tiles.exhausted)
+            fprintf(stderr,
+                    ", exceeded: %d of %d tiles limited to %u iterations (%llu iterations), %d "
+                    "tile levels filled from coarser samples.\n",
+                    (int)tiles.limited_tiles, tiles.schedule.num_bands, tiles.limit,
+                    (unsigned long long)tiles.degraded_iterations, (int)tiles.filled_tiles);
+        else
+            fprintf(stderr, ".\n");
+    }
+    free(order);
+    return success;
+}
+
+template <typename Sample>
+static int render_image(RenderJob& job) {
+    const int wid = job.width;
+    const int hei = job.height;
+    const int num_threads = job.num_threads < hei ? job.num_threads : hei;
+    pthread_t thread[num_threads];
+    int result = 0;
+    if (job.cmap_choice < 0 && !job.all_colormaps)
+        job.cmap_choice = random_next(job.rng) % COUNT(colormaps);
+
+    Sample* buffer;
+    uint32_t smin = max_steps + 1;
+    uint32_t smax = 0;
+    StepState* states = NULL;
+    size_t state_count = 0;
+    if (job.map != NULL && (job.pan_x != 0 || job.pan_y != 0)) {
+        buffer = (Sample*)malloc(sizeof(Sample) * wid * hei);
+        const bool keep_state = job.keep_state && job.dump_filename != NULL;
+        if (job.header.sample_size == sizeof(uint16_t))
+            pan_samples<Sample, uint16_t>(job, buffer, num_threads, keep_state, smin, smax,
+                                          states, state_count);
+        else
+            pan_samples<Sample, uint32_t>(job, buffer, num_threads, keep_state, smin, smax,
+                                          states, state_count);
+        // The dump may be overwritten below.
+        munmap(job.map, job.map_size);
+        job.map = NULL;
+    } else if (job.map != NULL && max_steps <= job.header.max_steps &&
+               job.dump_filename != NULL) {
+        // Saved again below (possibly over the mapped dump), so copied out of the mapping.
+        const StepsHeader& header = job.header;
+        buffer = (Sample*)malloc(sizeof(Sample) * wid * hei);
+        memcpy(buffer, (uint8_t*)job.map + header.header_size, sizeof(Sample) * wid * hei);
+        smin = header.smin;
+        smax = header.smax;
+        if (job.keep_state && header.state_count > 0) {
+            state_count = header.state_count;
+            states = (StepState*)malloc(sizeof(StepState) * state_count);
+            memcpy(states, (uint8_t*)job.map + steps_state_offset(header),
+                   sizeof(StepState) * state_count);
+        }
+        munmap(job.map, job.map_size);
+        job.map = NULL;
+    } else if (job.map != NULL && max_steps <= job.header.max_steps) {
+        buffer = (Sample*)((uint8_t*)job.map + job.header.header_size);
+        smin = job.header.smin;
+        smax = job.header.smax;
+    } else if (job.map != NULL) {
+        buffer = (Sample*)malloc(sizeof(Sample) * wid * hei);
+        if (job.header.sample_size == sizeof(uint16_t))
+            resume_samples<Sample, uint16_t>(job, buffer, num_threads, smin, smax, states,
+                                             state_count);
+        else
+            resume_samples<Sample, uint32_t>(job, buffer, num_threads, smin, smax, states,
+                                             state_count);
+        // The dump may be overwritten below.
+        munmap(job.map, job.map_size);
+        job.map = NULL;
+    } else {
+        buffer = (Sample*)malloc(sizeof(Sample) * wid * hei);
+        const bool keep_state = job.keep_state && job.dump_filename != NULL;
+        const uint32_t limit = max_steps;
+        if (job.adaptive && max_steps > ADAPTIVE_START_STEPS) max_steps = ADAPTIVE_START_STEPS;
+
+        BandSchedule schedule;
+        schedule.band_lines = CALC_BAND_LINES;
+        schedule.num_bands = (hei + CALC_BAND_LINES - 1) / CALC_BAND_LINES;
+        schedule.order = job.preview ? preview_band_order(*job.preview, hei, CALC_BAND_LINES,
+                                                          schedule.num_bands)
+                                     : NULL;
+        schedule.next = 0;
+        int* mirror = mirror_rows(job.y - job.dy, job.y + job.dy, hei);
+
+        CalcBufferData<Sample> cb_data[num_threads];
+        for (int t = 0; t < num_threads; t++) {
+            cb_data[t] = {t,
+                          buffer,
+                          &schedule,
+                          wid,
+                          hei,
+                          max_steps + 1,
+                          0,
+                          job.x - job.dx,
+                          job.x + job.dx,
+                          job.y - job.dy,
+                          job.y + job.dy,
+                          mirror,
+                          keep_state || job.adaptive,
+                          NULL,
+                          0,
+                          0,
+                          job.prove,
+                          0,
+                          0,
+                          0,
+                          1};
+            if (!job.progressive)
+                create_thread(thread + t, calc_buffer<Sample>, (void*)(cb_data + t));
+        }
+        if (job.progressive && !calc_levels(job, buffer, cb_data, num_threads)) result = 1;
+
+        for (int t = 0; t < num_threads; t++) {
+            if (!job.progressive) pthread_join(thread[t], NULL);
+#ifdef DEBUG
+            printf("Joined thread %d.\n", t);
+            fflush(stdout);
+#endif
+            if (cb_data[t].smin < smin) smin = cb_data[t].smin;
+            if (cb_data[t].smax > smax) smax = cb_data[t].smax;
+            state_count += cb_data[t].state_count;
+        }
+        free((void*)schedule.order);
+        if (job.prove) {
+            int interior_tiles = 0;
+            int escape_tiles = 0;
+            int fallback_tiles = 0;
+            for (int t = 0; t < num_threads; t++) {
+                interior_tiles += cb_data[t].interior_tiles;
+                escape_tiles += cb_data[t].escape_tiles;
+                fallback_tiles += cb_data[t].fallback_tiles;
+            }
+            fprintf(stderr,
+                    "Interval proofs: %d interior and %d escaping tiles proven, %d computed.\n",
+                    interior_tiles, escape_tiles, fallback_tiles);
+        }
+
+        if (state_count > 0) {
+            states = (StepState*)malloc(sizeof(StepState) * state_count);
+            StepState* s = states;
+            for (int t = 0; t < num_threads; t++) {
+                memcpy(s, cb_data[t].states, sizeof(StepState) * cb_data[t].state_count);
+                s += cb_data[t].state_count;
+                free(cb_data[t].states);
+            }
+            std::sort(states, states + state_count,
+                      [](const StepState& a, const StepState& b) { return a.index < b.index; });
+        }
+        if (mirror != NULL) {
+            copy_mirrored_rows(buffer, wid, hei, mirror, states, state_count);
+            free(mirror);
+        }
+
+        if (job.adaptive) {
+            adapt_limit(job, buffer, limit, num_threads, states, state_count);
+            sample_range(buffer, (size_t)wid * hei, smin, smax);
+            if (!keep_state) state_count = 0;
+        }
+    }
+
+    if (job_cancelled()) {
+        if (job.map != NULL)
+            munmap(job.map, job.map_size);
+        else
+            free(buffer);
+        free(states);
+        return 1;
+    }
+
+    if (job.map == NULL) {
+        if (job.dump_filename != NULL) {
+            StepsHeader& header = job.header;
+            memset(&header, 0, sizeof(StepsHeader));
+            memcpy(header.magic, STEPS_MAGIC, sizeof(header.magic));
+            header.version = STEPS_VERSION;
+            header.header_size = sizeof(StepsHeader);
+            header.width = wid;
+            header.height = hei;
+            header.sample_size = sizeof(Sample);
+            header.min_steps = min_steps;
+            header.max_steps = max_steps;
+            header.smin = smin;
+            header.smax = smax;
+            header.state_count = state_count;
+            split_coordinate(job.x, header.x);
+            split_coordinate(job.y, header.y);
+            split_coordinate(job.dx, header.dx);
+            split_coordinate(job.dy, header.dy);
+#ifdef DEBUG
+            printf("Saving iteration counts to %s.\n", job.dump_filename);
+            fflush(stdout);
+#endif
+            if (!save_steps(job.dump_filename, header, buffer, states)) {
+                free(buffer);
+                free(states);
+                return 1;
+            }
+        }
+        free(states);
+    }
+
+    AaSamples aa = {};
+    if (job.aa_samples > 0 && (job.filename != NULL || job.canvas != NULL))
+        antialias(job, buffer, smin, smax, num_threads, aa);
+
+    if (job.filename != NULL || job.canvas != NULL) {
+        const long double log_min = log(smin);
+        const long double log_max = log(smax);
+        long double log_delta;
+        if (log_max > log_min) {
+            log_delta = log_max - log_min;
+        } else {
+            log_delta = 1.0;
+            printf("WARNING: Selected window contains no detectable variation.\n");
+            fflush(stdout);
+        }
+
+        if (job.all_colormaps) {
+            GenVariantsData<Sample> gv_data[num_threads];
+            for (int t = 0; t < num_threads; t++) {
+                gv_data[t] = {t,         num_threads,  buffer,
+                              wid,       hei,          smin,
+                              smax,      log_min,      log_delta,
+                              job.filename, aa.count > 0 ? &aa : NULL, false};
+                create_thread(thread + t, gen_variants<Sample>, (void*)(gv_data + t));
+            }
+
+            for (int t = 0; t < num_threads; t++) {
+                pthread_join(thread[t], NULL);
+#ifdef DEBUG
+                printf("Joined thread %d.\n", t);
+                fflush(stdout);
+#endif
+                if (!gv_data[t].success) result = 1;
+            }
+        } else if (job.zoom != NULL) {
+            const int frames = job.zoom->last - job.zoom->first;
+            const int workers = frames < num_threads ? frames : num_threads;
+            GenFramesData<Sample> gf_data[workers];
+            for (int t = 0; t < workers; t++) {
+                gf_data[t] = {t,
+                              workers,
+                              job.zoom,
+                              buffer,
+                              wid,
+                              hei,
+                              job.dx,
+                              aa.count > 0 ? &aa : NULL,
+                              job.cmap_choice,
+                              job.stream,
+                              num_threads / workers,
+                              false};
+                create_thread(thread + t, gen_frames<Sample>, (void*)(gf_data + t));
+            }
+            for (int t = 0; t < workers; t++) {
+                pthread_join(thread[t], NULL);
+                if (!gf_data[t].success) result = 1;
+            }
+        } else if (job.outputs != NULL) {
+            BufferData* palette = (BufferData*)malloc(sizeof(BufferData) * (smax - smin + 1));
+            build_palette(palette, smin, smax, log_min, log_delta, colormaps[job.cmap_choice],
+                          colormap_sizes[job.cmap_choice] / 3 - 1);
+            const int workers = job.output_count < num_threads ? job.output_count : num_threads;
+            GenOutputsData<Sample> go_data[workers];
+            for (int t = 0; t < workers; t++) {
+                go_data[t] = {t,
+                              workers,
+                              job.outputs,
+                              job.output_count,
+                              num_threads / workers,
+                              {buffer, wid, hei, 0, 0, smin, smax, palette,
+                               aa.count > 0 ? &aa : NULL, 0, 0, 0, 0},
+                              false};
+                create_thread(thread + t, gen_outputs<Sample>, (void*)(go_data + t));
+            }
+            for (int t = 0; t < workers; t++) {
+                pthread_join(thread[t], NULL);
+                if (!go_data[t].success) result = 1;
+            }
+            free(palette);
+        } else if (job.canvas != NULL) {
+            BufferData* palette = (BufferData*)malloc(sizeof(BufferData) * (smax - smin + 1));
+            build_palette(palette, smin, smax, log_min, log_delta, colormaps[job.cmap_choice],
+                          colormap_sizes[job.cmap_choice] / 3 - 1);
+            ColorizeRowContext<Sample> context = {buffer, wid,     smin,
+                                                  smax,   palette, aa.count > 0 ? &aa : NULL};
+            for (int j = 0; j < hei; j++)
+                colorize_row<Sample>(&context, j, job.canvas + (size_t)j * job.canvas_width);
+            free(palette);
+        } else if (job.stream != NULL) {
+            BufferData* palette = (BufferData*)malloc(sizeof(BufferData) * (smax - smin + 1));
+            build_palette(palette, smin, smax, log_min, log_delta, colormaps[job.cmap_choice],
+                          colormap_sizes[job.cmap_choice] / 3 - 1);
+            ColorizeRowContext<Sample> context = {buffer, wid,     smin,
+                                                  smax,   palette, aa.count > 0 ? &aa : NULL};
+            if (!stream_frame(job.stream, 0, colorize_row<Sample>, &context, num_threads))
+                result = 1;
+            free(palette);
+        } else {
+#ifdef DEBUG
+            printf("Using colormap %d.\n", job.cmap_choice);
+#endif
+            if (!save_image(job.filename, buffer, wid, hei, smin, smax, log_min, log_delta,
+                            job.cmap_choice, aa.count > 0 ? &aa : NULL, num_threads))
+                result = 1;
+        }
+    }
+
+#ifdef DEBUG
+    printf("Done.\n");
+    fflush(stdout);
+#endif
+
+    free(aa.index);
+    free(aa.steps);
+    if (job.map != NULL)
+        munmap(job.map, job.map_size);
+    else
+        free(buffer);
+
+    return result;
+}
+
+template <typename Sample>
+static int render(RenderJob& job) {
+    // --adaptive lowers max_steps to the limit found for this image only, so that the next
+    // images of the thread (key frames, montage cells, daemon jobs) start from the -z MAX.
+    const uint32_t requested_steps = max_steps;
+    const int result = render_image<Sample>(job);
+    max_steps = requested_steps;
+    return result;
+}
+
+// Montage (--montage COLS ROWS): COLS x ROWS random windows of the -g size, each with its own
+// random generator, are rendered in parallel straight into the cells of a single canvas,
+// separated by MONTAGE_BORDER pixels of white on each side, which is written as one image.
+#define MONTAGE_BORDER 4
+
+struct MontageData {
+    const RenderJob* job;  // settings shared by the cells
+    int columns, rows;
+    bool center_set, size_set, nucleus;
+    int search_count;
+    double search_time;
+    uint64_t seed;
+    int cell_threads;
+    BufferData* canvas;
+    std::atomic<int>* next;
+    std::atomic<bool>* success;
+};
+
+static void* render_cells(void* p) {
+    MontageData* data = (MontageData*)p;
+    const int cell_width = data->job->width + 2 * MONTAGE_BORDER;
+    const int cell_height = data->job->height + 2 * MONTAGE_BORDER;
+    const int canvas_width = data->columns * cell_width;
+    for (int k = (*data->next)++; k < data->columns * data->rows; k = (*data->next)++) {
+        RenderJob job = *data->job;
+        job.rng = {random_bits(data->seed, k), 0};
+        job.num_threads = data->cell_threads;
+        job.canvas = data->canvas + (size_t)(k / data->columns * cell_height + MONTAGE_BORDER) *
+                                        canvas_width +
+                     k % data->columns * cell_width + MONTAGE_BORDER;
+        job.canvas_width = canvas_width;
+        bool size_set = data->size_set;
+        if (data->nucleus && data->center_set) {
+            if (!nucleus_window(job.rng, job.x, job.y, job.dx, job.dy, job.width, job.height,
+                                size_set)) {
+                fprintf(stderr, "Error: no minibrot nucleus found near (%Lg, %Lg).\n", job.x,
+                        job.y);
+                *data->success = false;
+                continue;
+            }
+            size_set = true;
+        }
+        if (data->search_count > 0 && !(data->center_set && size_set))
+            search_window(job.rng, job.x, job.y, job.dx, job.dy, job.width, job.height,
+                          data->center_set, size_set, data->nucleus, data->search_count,
+                          data->search_time, job.num_threads);
+        else
+            choose_window(job.rng, job.x, job.y, job.dx, job.dy, job.width, job.height,
+                          data->center_set, size_set, data->nucleus, job.num_threads);
+        const int result = max_steps < SAMPLE16_LIMIT ? render<uint16_t>(job)
+                                                      : render<uint32_t>(job);
+        if (result != 0) *data->success = false;
+    }
+    return NULL;
+}
+
+struct CanvasRowContext {
+    const BufferData* canvas;
+    int width;
+};
+
+static void canvas_row(void* p, int row, BufferData* pixels) {
+    CanvasRowContext* data = (CanvasRowContext*)p;
+    memcpy(pixels, data->canvas + (size_t)row * data->width, sizeof(BufferData) * data->width);
+}
+
+static int render_montage(MontageData& montage, const char* filename, int num_threads) {
+    const int cells = montage.columns * montage.rows;
+    const int canvas_width = montage.columns * (montage.job->width + 2 * MONTAGE_BORDER);
+    const int canvas_height = montage.rows * (montage.job->height + 2 * MONTAGE_BORDER);
+    BufferData* canvas =
+        (BufferData*)malloc(sizeof(BufferData) * (size_t)canvas_width * canvas_height);
+    memset(canvas, 0xFF, sizeof(BufferData) * (size_t)canvas_width * canvas_height);
+
+    // One cell per thread, or several threads per cell when there are fewer cells.
+    const int workers = num_threads < cells ? num_threads : cells;
+    std::atomic<int> next(0);
+    std::atomic<bool> success(true);
+    montage.cell_threads = num_threads / workers;
+    montage.canvas = canvas;
+    montage.next = &next;
+    montage.success = &success;
+    pthread_t thread[workers];
+    for (int t = 0; t < workers; t++) create_thread(thread + t, render_cells, (void*)&montage);
+    for (int t = 0; t < workers; t++) pthread_join(thread[t], NULL);
+
+    int result = success ? 0 : 1;
+    if (job_cancelled()) result = 1;
+    CanvasRowContext context = {canvas, canvas_width};
+    if (result == 0 &&
+        !write_png(filename, canvas_width, canvas_height, canvas_row, &context, num_threads)) {
+        fprintf(stderr, "Error: unable to write %s.\n", filename);
+        result = 1;
+    }
+    free(canvas);
+    return result;
+}
+
+// Render the key frames of the animation of job (see ZoomAnimation).
+template <typename Sample>
+static int render_zoom(RenderJob& job, ZoomAnimation& zoom) {
+    if (job.cmap_choice < 0) job.cmap_choice = random_next(job.rng) % COUNT(colormaps);
+    for (zoom.first = 0; zoom.first < zoom.frames; zoom.first = zoom.last) {
+        const long double key_zoom = zoom_factor(zoom, zoom.first);
+        for (zoom.last = zoom.first + 1; zoom.last < zoom.frames; zoom.last++)
+            if (zoom_factor(zoom, zoom.last) > key_zoom * ZOOM_KEY_SCALE * (1 + 1e-9L)) break;
+
+#ifdef DEBUG
+        printf("Key frame for frames %d to %d.\n", zoom.first, zoom.last - 1);
+        fflush(stdout);
+#endif
+
+        RenderJob key = job;
+        key.width = ZOOM_KEY_SCALE * zoom.width;
+        key.height = ZOOM_KEY_SCALE * zoom.height;
+        key.dx = job.dx / key_zoom;
+        key.dy = job.dy / key_zoom;
+        key.preview = NULL;  // its cost map is for the frame size and the first window
+        key.zoom = &zoom;
+        const int result = render<Sample>(key);
+        if (result != 0) return result;
+    }
+    return 0;
+}
+
+static int serve(const char* path, int num_threads, unsigned int seed);
+static int serve_tiles(int port, const char* options, int num_threads, unsigned int seed);
+static int load_test(int port, int connections, int requests, unsigned int seed);
+static int run_batch(const char* filename, int num_threads, unsigned int seed);
+
+// Run the command line argv (of the program or of a daemon job).
+static int run(int argc, char* argv[]) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    const char* filename = NULL;
+    const char* dump_filename = NULL;
+    const char* load_filename = NULL;
+    const char* atlas_filename = NULL;
+    const char* build_atlas_filename = NULL;
+    const char* daemon_path = NULL;
+    int tiles_port = 0;
+    int load_test_port = 0;
+    int load_test_connections = 0;
+    int load_test_requests = 0;
+    const char* batch_filename = NULL;
+    int montage_columns = 0;
+    int montage_rows = 0;
+    OutputImage outputs[MAX_OUTPUTS];
+    int output_count = 0;  // FILENAME is outputs[0] and the --sizes follow
+    int supersample = 1;
+    int aa_samples = 0;
+    double aa_cap = AA_DEFAULT_CAP;
+    int zoom_frames = 0;
+    int pan_x = 0;
+    int pan_y = 0;
+    long double zoom_scale = 1;
+    const char* stream_format = NULL;
+    int wid = 960;
+    int hei = 540;
+    bool center_set = false;
+    bool size_set = false;
+    long double x = 0;
+    long double y = 0;
+    long double dx = 0;
+    long double dy = 0;
+    int cmap_choice = -1;
+    bool all_colormaps = false;
+    bool pipeline = false;
+    bool keep_state = false;
+    bool adaptive = false;
+    bool prove = false;
+    bool progressive = false;
+    bool level_images = false;
+    double deadline = 0;
+    uint64_t iter_budget = 0;
+    bool steps_set = false;
+    bool norm_set = false;
+    uint32_t norm_min = 0;
+    uint32_t norm_max = 0;
+    int preview_scale = 0;
+    int search_count = 0;
+    double search_time = 0;
+    bool nucleus = false;
+    unsigned int seed = time(NULL);
+    int num_threads = get_nprocs() - 1;
+    if (num_threads <= 0) num_threads = 1;
+
+    for (int i = 1; i < argc; i++) {
+#ifdef DEBUG
+        printf("Parsing argument %s\n", argv[i]);
+#endif
+        if (argv[i][0] != '-' || argv[i][1] == '\0') {
+            filename = argv[i];
+#ifdef DEBUG
+            printf("Output filename: %s\n", filename);
+#endif
+            continue;
+        }
+        switch (argv[i][1]) {
+            case 'h':
+                printf(
+                    "Usage: %s [OPTION]... FILENAME\n\n"
+                    "Options:\n"
+                    "  -h                    Show this help message and exit.\n"
+                    "  -g WIDTH HEIGHT       Image size (defaults %d %d).\n"
+                    "  -c X Y                View window center.\n"
+                    "  -s DX DY              View window size.\n"
+                    "  -z MIN MAX            Minimal value to accept a random "
+                    "coordinate as image\n"
                     "                        center and maximal value for the "
                     "fractal calculation\n"
                     "                        (defaults %u %u).\n"
-                    "  -m COLORMAP           Colormap name. Available "
+                    "  -m COLORMAP           Colormap name or 'all' to generate one image per\n"
+                    "                        colormap (named FILENAME-COLORMAP).  Available "
                     "options:\n",
                     argv[0], wid, hei, min_steps, max_steps);
                 for (int i = 0; i < COUNT(colormap_names);) {
@@ -206,7 +3492,73 @@ int main(int argc, char* argv[]) {
                 }
                 printf(
                     "  -r RNG_SEED           Random number generator seed.\n"
-                    "  -p NUM                Number of threads to use (default %d).\n",
+                    "  -p NUM                Number of threads to use (default %d).\n"
+                    "  -d FILE               Save the iteration counts to FILE (FILENAME\n"
+                    "                        becomes optional).\n"
+                    "  -l FILE               Load the iteration counts from FILE instead of\n"
+                    "                        computing them (ignores -g, -c, -s and -z, unless\n"
+                    "                        -z MAX is larger than in FILE: the pixels that\n"
+                    "                        did not escape are then continued up to MAX).\n"
+                    "  --pan DX DY           Shift the window of -l FILE by DX DY pixels\n"
+                    "                        (right and down) and only compute the pixels\n"
+                    "                        it exposes.\n"
+                    "  --resumable           Save the state of the pixels that did not escape\n"
+                    "                        with -d, so that -l continues them from there.\n"
+                    "  --adaptive            Start with a low iteration limit and raise it up\n"
+                    "                        to MAX (see -z) only for the limited pixels on\n"
+                    "                        the boundary, as long as it resolves them.\n"
+                    "  --prove               Fill the tiles proven to be inside the set or to\n"
+                    "                        escape uniformly (by interval arithmetic)\n"
+                    "                        without computing their pixels.\n"
+                    "  --progressive         Compute 1/16 of the pixels, then 1/4, then all,\n"
+                    "                        from the center of the image outward.\n"
+                    "  --progressive-images  Same, also saving the first two levels as\n"
+                    "                        FILENAME-1of16 and FILENAME-1of4.\n"
+                    "  --deadline MS         Computation deadline since the start (implies\n"
+                    "                        --progressive): past it, the remaining pixels\n"
+                    "                        are filled from the coarser levels.\n"
+                    "  --iter-budget NUM     Same with a total number of iterations.\n"
+                    "  --daemon PATH         Serve render jobs (lines of an ID and options)\n"
+                    "                        on the Unix socket PATH, or on the standard\n"
+                    "                        input and output if PATH is -.\n"
+                    "  --tiles PORT          Serve /Z/X/Y.png map tiles over HTTP on the\n"
+                    "                        local port PORT (see -z, -m and --norm).\n"
+                    "  --load-test PORT CONNECTIONS REQUESTS\n"
+                    "                        Request random tiles from the tile server on\n"
+                    "                        PORT and report the throughput and latency.\n"
+                    "  --batch FILE          Render the jobs of FILE (one line of options\n"
+                    "                        per image), concurrently when they are small.\n"
+                    "  --montage COLS ROWS   Render COLS x ROWS random windows of the -g size\n"
+                    "                        into the cells of a single image.\n"
+                    "  --sizes WxH[,WxH]...  Also save the image downsampled to these sizes\n"
+                    "                        (named FILENAME-WxH).\n"
+                    "  --supersample NUM     Compute NUM x NUM samples per pixel of FILENAME\n"
+                    "                        (and of the --sizes) and average them.\n"
+                    "  --aa NUM              Anti-alias the edges with NUM more samples in\n"
+                    "                        the pixels that differ from their neighbors.\n"
+                    "  --aa-cap FRACTION     Maximal fraction of the pixels anti-aliased\n"
+                    "                        (default 0.1).\n"
+                    "  --zoom FRAMES SCALE   Save FRAMES frames (named FILENAME-0000...)\n"
+                    "                        zooming SCALE times into the window center.\n"
+                    "  --stream FORMAT       Write the image (or --zoom frames) to FILENAME\n"
+                    "                        (- for the standard output) as uncompressed\n"
+                    "                        y4m or rgba video frames instead of PNG.\n"
+                    "  --pipeline            Overlap computation, colorization and encoding\n"
+                    "                        (colors normalized from a preview or --norm).\n"
+                    "  --norm MIN MAX        Fixed iteration range used for colorization.\n"
+                    "  --preview SCALE       Check the window with a 1/SCALE resolution preview\n"
+                    "                        before rendering: flat or uniform windows are\n"
+                    "                        replaced by a new random one (or rejected if the\n"
+                    "                        center is set).\n"
+                    "  --search NUM          Score NUM random windows on tiny previews and\n"
+                    "                        render the most interesting one.\n"
+                    "  --search-time MS      Time budget for --search (default unlimited).\n"
+                    "  --nucleus             Center the window on the nucleus of the minibrot\n"
+                    "                        nearest to the (random or set) center and size\n"
+                    "                        it after the minibrot unless -s is given.\n"
+                    "  --build-atlas FILE    Precompute an atlas of random centers up to MAX\n"
+                    "                        iterations (see -z) into FILE and exit.\n"
+                    "  --atlas FILE          Draw random centers from the atlas in FILE.\n",
                     num_threads);
                 return 0;
                 break;
@@ -264,6 +3616,7 @@ int main(int argc, char* argv[]) {
                     return 1;
                 }
                 max_steps = strtoul(argv[i], NULL, 0);
+                steps_set = true;
                 if (min_steps >= max_steps) {
                     fprintf(stderr, "MIN (%u) must be greater than MAX (%u).\n", min_steps,
                             max_steps);
@@ -275,38 +3628,283 @@ int main(int argc, char* argv[]) {
                     fprintf(stderr, "Error: missing value after option %s.\n", argv[i - 1]);
                     return 1;
                 }
+                if (strcmp(argv[i], "all") == 0) {
+                    all_colormaps = true;
+                    break;
+                }
                 for (int j = 0; j < COUNT(colormaps); j++) {
                     if (strcmp(argv[i], colormap_names[j]) == 0) {
                         cmap_choice = j;
                         break;
                     }
-                }
-                if (cmap_choice < 0) {
-                    fprintf(stderr,
-                            "Error: invalid colormap choice %s.  Try -h for "
-                            "help.\n",
-                            argv[i]);
-                    return 1;
-                }
-                break;
-            case 'r':
-                if (++i == argc) {
-                    fprintf(stderr, "Error: missing value after option %s.\n", argv[i - 1]);
-                    return 1;
-                }
-                seed = strtoul(argv[i], NULL, 0);
-                break;
-            case 'p':
-                if (++i == argc) {
-                    fprintf(stderr, "Error: missing value after option %s.\n", argv[i - 1]);
-                    return 1;
-                }
-                num_threads = atoi(argv[i]);
-                if (num_threads <= 0) {
-                    fprintf(stderr,
-                            "Error: invalid value for number of threads (%s == "
-                            "%d).\n",
-                            argv[i], num_threads);
+                }
+                if (cmap_choice < 0) {
+                    fprintf(stderr,
+                            "Error: invalid colormap choice %s.  Try -h for "
+                            "help.\n",
+                            argv[i]);
+                    return 1;
+                }
+                break;
+            case 'r':
+                if (++i == argc) {
+                    fprintf(stderr, "Error: missing value after option %s.\n", argv[i - 1]);
+                    return 1;
+                }
+                seed = strtoul(argv[i], NULL, 0);
+                break;
+            case 'p':
+                if (++i == argc) {
+                    fprintf(stderr, "Error: missing value after option %s.\n", argv[i - 1]);
+                    return 1;
+                }
+                num_threads = atoi(argv[i]);
+                if (num_threads <= 0) {
+                    fprintf(stderr,
+                            "Error: invalid value for number of threads (%s == "
+                            "%d).\n",
+                            argv[i], num_threads);
+                    return 1;
+                }
+                break;
+            case 'd':
+                if (++i == argc) {
+                    fprintf(stderr, "Error: missing value after option %s.\n", argv[i - 1]);
+                    return 1;
+                }
+                dump_filename = argv[i];
+                break;
+            case 'l':
+                if (++i == argc) {
+                    fprintf(stderr, "Error: missing value after option %s.\n", argv[i - 1]);
+                    return 1;
+                }
+                load_filename = argv[i];
+                break;
+            case '-':
+                if (strcmp(argv[i], "--pipeline") == 0) {
+                    pipeline = true;
+                } else if (strcmp(argv[i], "--resumable") == 0) {
+                    keep_state = true;
+                } else if (strcmp(argv[i], "--adaptive") == 0) {
+                    adaptive = true;
+                } else if (strcmp(argv[i], "--prove") == 0) {
+                    prove = true;
+                } else if (strcmp(argv[i], "--progressive") == 0) {
+                    progressive = true;
+                } else if (strcmp(argv[i], "--progressive-images") == 0) {
+                    progressive = true;
+                    level_images = true;
+                } else if (strcmp(argv[i], "--nucleus") == 0) {
+                    nucleus = true;
+                } else if (strcmp(argv[i], "--atlas") == 0) {
+                    if (++i == argc) {
+                        fprintf(stderr, "Error: missing value after option %s.\n", argv[i - 1]);
+                        return 1;
+                    }
+                    atlas_filename = argv[i];
+                } else if (strcmp(argv[i], "--build-atlas") == 0) {
+                    if (++i == argc) {
+                        fprintf(stderr, "Error: missing value after option %s.\n", argv[i - 1]);
+                        return 1;
+                    }
+                    build_atlas_filename = argv[i];
+                } else if (strcmp(argv[i], "--norm") == 0) {
+                    if (++i == argc) {
+                        fprintf(stderr, "Error: missing value after option %s.\n", argv[i - 1]);
+                        return 1;
+                    }
+                    norm_min = strtoul(argv[i], NULL, 0);
+                    if (++i == argc) {
+                        fprintf(stderr, "Error: missing value after option %s.\n", argv[i - 2]);
+                        return 1;
+                    }
+                    norm_max = strtoul(argv[i], NULL, 0);
+                    if (norm_min >= norm_max) {
+                        fprintf(stderr, "MIN (%u) must be less than MAX (%u).\n", norm_min,
+                                norm_max);
+                        return 1;
+                    }
+                    norm_set = true;
+                } else if (strcmp(argv[i], "--search") == 0) {
+                    if (++i == argc) {
+                        fprintf(stderr, "Error: missing value after option %s.\n", argv[i - 1]);
+                        return 1;
+                    }
+                    search_count = atoi(argv[i]);
+                    if (search_count <= 0) {
+                        fprintf(stderr, "Error: invalid number of candidates %s.\n", argv[i]);
+                        return 1;
+                    }
+                } else if (strcmp(argv[i], "--search-time") == 0) {
+                    if (++i == argc) {
+                        fprintf(stderr, "Error: missing value after option %s.\n", argv[i - 1]);
+                        return 1;
+                    }
+                    search_time = strtod(argv[i], NULL);
+                } else if (strcmp(argv[i], "--daemon") == 0) {
+                    if (++i == argc) {
+                        fprintf(stderr, "Error: missing value after option %s.\n", argv[i - 1]);
+                        return 1;
+                    }
+                    daemon_path = argv[i];
+                } else if (strcmp(argv[i], "--tiles") == 0) {
+                    if (++i == argc) {
+                        fprintf(stderr, "Error: missing value after option %s.\n", argv[i - 1]);
+                        return 1;
+                    }
+                    tiles_port = atoi(argv[i]);
+                    if (tiles_port <= 0 || tiles_port > 65535) {
+                        fprintf(stderr, "Error: invalid port %s.\n", argv[i]);
+                        return 1;
+                    }
+                } else if (strcmp(argv[i], "--load-test") == 0) {
+                    if (i + 3 >= argc) {
+                        fprintf(stderr, "Error: missing value after option %s.\n", argv[i]);
+                        return 1;
+                    }
+                    load_test_port = atoi(argv[++i]);
+                    load_test_connections = atoi(argv[++i]);
+                    load_test_requests = atoi(argv[++i]);
+                    if (load_test_port <= 0 || load_test_port > 65535 ||
+                        load_test_connections <= 0 || load_test_requests <= 0) {
+                        fprintf(stderr, "Error: invalid load test %s %s %s.\n", argv[i - 2],
+                                argv[i - 1], argv[i]);
+                        return 1;
+                    }
+                } else if (strcmp(argv[i], "--montage") == 0) {
+                    if (i + 2 >= argc) {
+                        fprintf(stderr, "Error: missing value after option %s.\n", argv[i]);
+                        return 1;
+                    }
+                    montage_columns = atoi(argv[++i]);
+                    montage_rows = atoi(argv[++i]);
+                    if (montage_columns <= 0 || montage_rows <= 0) {
+                        fprintf(stderr, "Error: invalid montage size %s %s.\n", argv[i - 1],
+                                argv[i]);
+                        return 1;
+                    }
+                } else if (strcmp(argv[i], "--sizes") == 0) {
+                    if (++i == argc) {
+                        fprintf(stderr, "Error: missing value after option %s.\n", argv[i - 1]);
+                        return 1;
+                    }
+                    output_count = 1;
+                    for (const char* p = argv[i]; p != NULL; p = strchr(p, ',')) {
+                        if (*p == ',') p++;
+                        if (output_count == MAX_OUTPUTS) {
+                            fprintf(stderr, "Error: more than %d output sizes.\n",
+                                    MAX_OUTPUTS - 1);
+                            return 1;
+                        }
+                        OutputImage& output = outputs[output_count];
+                        int n = 0;
+                        if (sscanf(p, "%dx%d%n", &output.width, &output.height, &n) != 2 ||
+                            output.width <= 0 || output.height <= 0 ||
+                            (p[n] != ',' && p[n] != '\0')) {
+                            fprintf(stderr, "Error: invalid output sizes %s.\n", argv[i]);
+                            return 1;
+                        }
+                        output_count++;
+                    }
+                } else if (strcmp(argv[i], "--supersample") == 0) {
+                    if (++i == argc) {
+                        fprintf(stderr, "Error: missing value after option %s.\n", argv[i - 1]);
+                        return 1;
+                    }
+                    supersample = atoi(argv[i]);
+                    if (supersample < 1) {
+                        fprintf(stderr, "Error: invalid supersampling factor %s.\n", argv[i]);
+                        return 1;
+                    }
+                } else if (strcmp(argv[i], "--zoom") == 0) {
+                    if (i + 2 >= argc) {
+                        fprintf(stderr, "Error: missing value after option %s.\n", argv[i]);
+                        return 1;
+                    }
+                    zoom_frames = atoi(argv[++i]);
+                    zoom_scale = strtold(argv[++i], NULL);
+                    if (zoom_frames <= 0 || zoom_scale < 1) {
+                        fprintf(stderr, "Error: invalid zoom %s %s.\n", argv[i - 1], argv[i]);
+                        return 1;
+                    }
+                } else if (strcmp(argv[i], "--pan") == 0) {
+                    if (i + 2 >= argc) {
+                        fprintf(stderr, "Error: missing value after option %s.\n", argv[i]);
+                        return 1;
+                    }
+                    pan_x = atoi(argv[++i]);
+                    pan_y = atoi(argv[++i]);
+                } else if (strcmp(argv[i], "--stream") == 0) {
+                    if (i + 1 >= argc) {
+                        fprintf(stderr, "Error: missing value after option %s.\n", argv[i]);
+                        return 1;
+                    }
+                    stream_format = argv[++i];
+                    if (strcmp(stream_format, "y4m") != 0 && strcmp(stream_format, "rgba") != 0) {
+                        fprintf(stderr, "Error: unknown stream format %s.\n", stream_format);
+                        return 1;
+                    }
+                } else if (strcmp(argv[i], "--aa") == 0) {
+                    if (++i == argc) {
+                        fprintf(stderr, "Error: missing value after option %s.\n", argv[i - 1]);
+                        return 1;
+                    }
+                    aa_samples = atoi(argv[i]);
+                    if (aa_samples <= 0) {
+                        fprintf(stderr, "Error: invalid number of samples %s.\n", argv[i]);
+                        return 1;
+                    }
+                } else if (strcmp(argv[i], "--aa-cap") == 0) {
+                    if (++i == argc) {
+                        fprintf(stderr, "Error: missing value after option %s.\n", argv[i - 1]);
+                        return 1;
+                    }
+                    aa_cap = strtod(argv[i], NULL);
+                    if (aa_cap <= 0 || aa_cap > 1) {
+                        fprintf(stderr, "Error: invalid anti-aliasing cap %s.\n", argv[i]);
+                        return 1;
+                    }
+                } else if (strcmp(argv[i], "--batch") == 0) {
+                    if (++i == argc) {
+                        fprintf(stderr, "Error: missing value after option %s.\n", argv[i - 1]);
+                        return 1;
+                    }
+                    batch_filename = argv[i];
+                } else if (strcmp(argv[i], "--deadline") == 0) {
+                    if (++i == argc) {
+                        fprintf(stderr, "Error: missing value after option %s.\n", argv[i - 1]);
+                        return 1;
+                    }
+                    deadline = strtod(argv[i], NULL);
+                    if (deadline <= 0) {
+                        fprintf(stderr, "Error: invalid deadline %s.\n", argv[i]);
+                        return 1;
+                    }
+                    progressive = true;
+                } else if (strcmp(argv[i], "--iter-budget") == 0) {
+                    if (++i == argc) {
+                        fprintf(stderr, "Error: missing value after option %s.\n", argv[i - 1]);
+                        return 1;
+                    }
+                    iter_budget = strtoull(argv[i], NULL, 10);
+                    if (iter_budget == 0) {
+                        fprintf(stderr, "Error: invalid iteration budget %s.\n", argv[i]);
+                        return 1;
+                    }
+                    progressive = true;
+                } else if (strcmp(argv[i], "--preview") == 0) {
+                    if (++i == argc) {
+                        fprintf(stderr, "Error: missing value after option %s.\n", argv[i - 1]);
+                        return 1;
+                    }
+                    preview_scale = atoi(argv[i]);
+                    if (preview_scale < 2) {
+                        fprintf(stderr, "Error: invalid preview scale %s.\n", argv[i]);
+                        return 1;
+                    }
+                } else {
+                    fprintf(stderr, "Error: unexpected parameter %s.\n", argv[i]);
                     return 1;
                 }
                 break;
@@ -316,124 +3914,946 @@ int main(int argc, char* argv[]) {
         }
     }
 
-    if (filename == NULL) {
+    if (daemon_job != NULL &&
+        (daemon_path != NULL || batch_filename != NULL || atlas_filename != NULL ||
+         build_atlas_filename != NULL || tiles_port > 0 || load_test_port > 0)) {
+        fprintf(stderr, "Error: --daemon, --batch, --tiles, --load-test, --atlas and "
+                        "--build-atlas are not valid in a job.\n");
+        return 1;
+    }
+
+    if (load_test_port > 0)
+        return load_test(load_test_port, load_test_connections, load_test_requests, seed);
+
+    if (tiles_port > 0) {
+        if (cmap_choice < 0 || all_colormaps) {
+            Random rng = {seed, 0};
+            cmap_choice = random_next(rng) % COUNT(colormaps);
+        }
+        if (!norm_set || norm_max > max_steps) norm_max = max_steps;
+        if (!norm_set || norm_min >= norm_max) norm_min = 0;
+        char options[256];
+        snprintf(options, sizeof(options), "-z %u %u -m %s --pipeline --norm %u %u", min_steps,
+                 max_steps, colormap_names[cmap_choice], norm_min, norm_max);
+        return serve_tiles(tiles_port, options, num_threads, seed);
+    }
+
+    if (build_atlas_filename != NULL) return build_atlas(build_atlas_filename, num_threads);
+
+    if (daemon_path != NULL || batch_filename != NULL) {
+        if (atlas_filename != NULL && !load_atlas(atlas_filename)) return 1;
+        return daemon_path != NULL ? serve(daemon_path, num_threads, seed)
+                                   : run_batch(batch_filename, num_threads, seed);
+    }
+
+    if (filename == NULL && dump_filename == NULL) {
         fprintf(stderr, "Error: missing filename!\nUsage: %s [OPTIONS] FILENAME\n", argv[0]);
         return 1;
     }
 
+    if (pipeline && (filename == NULL || dump_filename != NULL || load_filename != NULL ||
+                     all_colormaps)) {
+        fprintf(stderr, "Error: --pipeline cannot be combined with -d, -l or -m all.\n");
+        return 1;
+    }
+
+    if (daemon_job != NULL && filename != NULL && strcmp(filename, "-") == 0 &&
+        (all_colormaps || level_images || (zoom_frames > 0 && stream_format == NULL))) {
+        fprintf(stderr, "Error: FILENAME - cannot be combined with -m all, "
+                        "--progressive-images or --zoom.\n");
+        return 1;
+    }
+
+    if (montage_columns > 0 &&
+        (filename == NULL || dump_filename != NULL || load_filename != NULL || pipeline ||
+         all_colormaps || level_images || preview_scale > 0)) {
+        fprintf(stderr,
+                "Error: --montage needs FILENAME and cannot be combined with -d, -l, -m all, "
+                "--pipeline, --progressive-images or --preview.\n");
+        return 1;
+    }
+
+    if ((output_count > 0 || supersample > 1) &&
+        (filename == NULL || all_colormaps || pipeline || montage_columns > 0 ||
+         (supersample > 1 && load_filename != NULL))) {
+        fprintf(stderr,
+                "Error: --sizes and --supersample need FILENAME and cannot be combined with -m "
+                "all, --pipeline or --montage (nor -l for --supersample).\n");
+        return 1;
+    }
+
+    if (zoom_frames > 0 &&
+        (filename == NULL || dump_filename != NULL || load_filename != NULL || pipeline ||
+         all_colormaps || level_images || montage_columns > 0 || output_count > 0 ||
+         supersample > 1 || wid < 2 || hei < 2)) {
+        fprintf(stderr,
+                "Error: --zoom needs FILENAME, at least 2 x 2 pixels and cannot be combined with "
+                "-d, -l, -m all, --pipeline, --progressive-images, --montage, --sizes or "
+                "--supersample.\n");
+        return 1;
+    }
+
+    if (stream_format != NULL &&
+        (filename == NULL || pipeline || all_colormaps || level_images || montage_columns > 0 ||
+         output_count > 0)) {
+        fprintf(stderr,
+                "Error: --stream needs FILENAME and cannot be combined with -m all, --pipeline, "
+                "--progressive-images, --montage or --sizes.\n");
+        return 1;
+    }
+
+    if ((pan_x != 0 || pan_y != 0) && (load_filename == NULL || pipeline)) {
+        fprintf(stderr, "Error: --pan needs -l and cannot be combined with --pipeline.\n");
+        return 1;
+    }
+
+    if (aa_samples > 0 && pipeline) {
+        fprintf(stderr, "Error: --aa cannot be combined with --pipeline.\n");
+        return 1;
+    }
+
+    if (level_images && all_colormaps) {
+        fprintf(stderr, "Error: --progressive-images cannot be combined with -m all.\n");
+        return 1;
+    }
+
+    if (progressive && (pipeline || prove || load_filename != NULL)) {
+        fprintf(stderr,
+                "Error: --progressive, --deadline and --iter-budget cannot be combined with "
+                "--pipeline, --prove or -l.\n");
+        return 1;
+    }
+
+    if (adaptive && (pipeline || load_filename != NULL || deadline > 0 || iter_budget > 0)) {
+        fprintf(stderr,
+                "Error: --adaptive cannot be combined with --pipeline, -l, --deadline or "
+                "--iter-budget.\n");
+        return 1;
+    }
+
 #ifdef DEBUG
     printf("Seed: %u\nRunning with %d threads.\nImage size: %d x %d\n", seed, num_threads, wid,
            hei);
 #endif
 
-    srand(seed);
+    Random rng = {seed, 0};
 
-    uint32_t steps;
-    if (center_set)
-        steps = mandelbrot(x, y);
-    else
-        steps = choose_center(x, y);
+    if (load_filename == NULL) {
+        if (atlas_filename != NULL && !load_atlas(atlas_filename)) return 1;
+        // The atlas of a daemon is shared by its jobs.
+        if (atlas.header != NULL && atlas.header->max_steps < max_steps) {
+            fprintf(stderr, "Error: the atlas only covers up to %u iterations (MAX is %u).\n",
+                    atlas.header->max_steps, max_steps);
+            return 1;
+        }
+    }
 
-    if (!size_set) {
-        dx = powl(steps, rand_range(-2.5, -1));
-        dy = dx * hei / wid;
+    StepsHeader header = {};
+    void* map = NULL;
+    size_t map_size = 0;
+    if (load_filename != NULL) {
+        map = load_steps(load_filename, header, map_size);
+        if (map == NULL) return 1;
+        wid = header.width;
+        hei = header.height;
+        // A larger MAX continues the pixels that did not escape in the dump.
+        if (!steps_set || max_steps <= header.max_steps) {
+            min_steps = header.min_steps;
+            max_steps = header.max_steps;
+        }
+        x = join_coordinate(header.x);
+        y = join_coordinate(header.y);
+        dx = join_coordinate(header.dx);
+        dy = join_coordinate(header.dy);
+        if (pan_x != 0 || pan_y != 0) {
+            if (max_steps > header.max_steps || (pan_x != 0 && wid < 2) ||
+                (pan_y != 0 && hei < 2)) {
+                fprintf(stderr, "Error: --pan cannot raise MAX nor shift a single pixel "
+                                "row or column.\n");
+                munmap(map, map_size);
+                return 1;
+            }
+            // One pixel is 2 * dx / (wid - 1) apart (see pixel_coordinate).
+            x += 2 * dx * pan_x / (wid - 1);
+            y += 2 * dy * pan_y / (hei - 1);
+        }
+#ifdef DEBUG
+        printf("Loaded %s: %d x %d, steps %u to %u.\n", load_filename, wid, hei, header.smin,
+               header.smax);
+#endif
+    } else if (montage_columns == 0) {
+        if (nucleus && center_set) {
+            if (!nucleus_window(rng, x, y, dx, dy, wid, hei, size_set)) {
+                fprintf(stderr, "Error: no minibrot nucleus found near (%Lg, %Lg).\n", x, y);
+                return 1;
+            }
+            size_set = true;
+        }
+        if (search_count > 0 && !(center_set && size_set))
+            search_window(rng, x, y, dx, dy, wid, hei, center_set, size_set, nucleus,
+                          search_count, search_time, num_threads);
+        else
+            choose_window(rng, x, y, dx, dy, wid, hei, center_set, size_set, nucleus,
+                          num_threads);
     }
 
 #ifdef DEBUG
     printf("Image window: (%Lg, %Lg) x (%Lg, %Lg).\n", x - dx, y - dy, x + dx, y + dy);
 #endif
 
-    if (cmap_choice < 0) cmap_choice = rand() % COUNT(colormaps);
+    // FILENAME at the -g size (computed supersample times larger), then the other sizes.
+    if (output_count > 0 || supersample > 1) {
+        snprintf(outputs[0].filename, sizeof(outputs[0].filename), "%s", filename);
+        outputs[0].width = wid;
+        outputs[0].height = hei;
+        if (output_count == 0) output_count = 1;
+        wid *= supersample;
+        hei *= supersample;
+        for (int k = 1; k < output_count; k++) {
+            if (outputs[k].width > wid || outputs[k].height > hei) {
+                fprintf(stderr, "Error: output size %dx%d is larger than the image (%dx%d).\n",
+                        outputs[k].width, outputs[k].height, wid, hei);
+                if (map != NULL) munmap(map, map_size);
+                return 1;
+            }
+            char size[32];
+            snprintf(size, sizeof(size), "%dx%d", outputs[k].width, outputs[k].height);
+            variant_filename(outputs[k].filename, sizeof(outputs[k].filename), filename, size);
+        }
+    }
+
+    if (norm_set && norm_max > max_steps) norm_max = max_steps;
+    if (norm_set && norm_min >= norm_max) {
+        fprintf(stderr, "Error: normalization range must be below MAX (%u).\n", max_steps);
+        if (map != NULL) munmap(map, map_size);
+        return 1;
+    }
+    // Samples store 1 + the number of iterations.
+    RenderJob job = {filename,
+                     dump_filename,
+                     wid,
+                     hei,
+                     x,
+                     y,
+                     dx,
+                     dy,
+                     cmap_choice,
+                     all_colormaps,
+                     num_threads,
+                     map,
+                     map_size,
+                     header,
+                     pan_x,
+                     pan_y,
+                     keep_state,
+                     adaptive,
+                     prove,
+                     progressive,
+                     level_images,
+                     deadline,
+                     iter_budget,
+                     start,
+                     NULL,
+                     0,
+                     output_count > 0 ? outputs : NULL,
+                     output_count,
+                     aa_samples,
+                     aa_cap,
+                     NULL,
+                     NULL,
+                     pipeline,
+                     norm_set,
+                     norm_min + 1,
+                     norm_max + 1,
+                     NULL,
+                     rng};
+    const bool compact = map != NULL && max_steps == header.max_steps
+                             ? header.sample_size == sizeof(uint16_t)
+                             : max_steps < SAMPLE16_LIMIT;
+
+    if (montage_columns > 0) {
+        // The cells choose their windows.
+        MontageData montage = {&job,         montage_columns, montage_rows,
+                               center_set,   size_set,        nucleus,
+                               search_count, search_time,     random_next(job.rng),
+                               0,            NULL,            NULL,
+                               NULL};
+        return render_montage(montage, filename, num_threads);
+    }
 
+    Preview preview = {};
+    if (preview_scale > 0 && map == NULL) {
+        for (int attempt = 1;; attempt++) {
+            compute_preview(job, preview_scale, preview);
+            if (!preview_is_boring(preview)) break;
+            if (center_set || attempt == PREVIEW_MAX_ATTEMPTS) {
+                fprintf(stderr, "Error: selected window contains no detectable variation.\n");
+                free(preview.steps);
+                return 1;
+            }
+            choose_window(job.rng, job.x, job.y, job.dx, job.dy, wid, hei, center_set, size_set,
+                          nucleus, num_threads);
 #ifdef DEBUG
-    printf("Using colormap %d.\n", cmap_choice);
+            printf("Window rejected by the preview, trying (%Lg, %Lg) x (%Lg, %Lg).\n",
+                   job.x - job.dx, job.y - job.dy, job.x + job.dx, job.y + job.dy);
 #endif
+        }
+        job.preview = &preview;
+    }
+
+    FrameStream stream;
+    if (stream_format != NULL) {
+        FILE* out;
+        if (daemon_job == NULL && strcmp(filename, "-") == 0) {
+            // Keep the messages out of the stream.
+            out = fdopen(dup(STDOUT_FILENO), "wb");
+            dup2(STDERR_FILENO, STDOUT_FILENO);
+        } else {
+            out = open_output(filename);
+        }
+        if (out == NULL) {
+            fprintf(stderr, "Error: unable to open %s.\n", filename);
+            free(preview.steps);
+            return 1;
+        }
+        open_stream(&stream, out, strcmp(stream_format, "y4m") == 0, wid, hei);
+        job.stream = &stream;
+    }
+
+    int result;
+    if (zoom_frames > 0) {
+        ZoomAnimation zoom = {filename, zoom_frames, zoom_scale, wid, hei, job.dx, 0, 0};
+        result = compact ? render_zoom<uint16_t>(job, zoom) : render_zoom<uint32_t>(job, zoom);
+    } else if (pipeline)
+        result = render_pipeline(job);
+    else
+        result = compact ? render<uint16_t>(job) : render<uint32_t>(job);
+    if (stream_format != NULL && !close_stream(&stream)) {
+        fprintf(stderr, "Error: unable to write %s.\n", filename);
+        result = 1;
+    }
+    free(preview.steps);
+    return result;
+}
 
-    uint8_t* colormap = (uint8_t*)colormaps[cmap_choice];
-    const int max_index = colormap_sizes[cmap_choice] / 3 - 1;
+// Daemon mode (--daemon PATH): render jobs are read as lines "ID OPTION... [FILENAME]", with
+// the options of the command line, from the clients of the Unix domain socket PATH or from
+// the standard input if PATH is "-".  "cancel ID" cancels a queued or running job of the
+// client, as does its disconnection from the socket.  Each job is answered with a line "ok ID"
+// (or "ok ID SIZE" followed by SIZE bytes of PNG for FILENAME "-"), "cancelled ID" or "error
+// ID"; the messages of the jobs go to the standard error with PATH "-".
+//
+// Batch mode (--batch FILE) runs the jobs of FILE, one per line without ID, the same way.
+//
+// Jobs start in arrival order, as soon as enough of the threads of the daemon (-p) are free
+// for them.  Unless a job sets -p, it uses one thread per JOB_PIXELS_PER_THREAD pixels, so
+// that small images render concurrently with one thread each and large ones are split
+// across all the threads.  Lines starting with '#' are ignored.
+#define JOB_PIXELS_PER_THREAD (1 << 19)
 
-    BufferData* buffer = (BufferData*)malloc(sizeof(BufferData) * wid * hei);
-    const int lines_per_thread = hei / num_threads + 1;
-    const int pitch = lines_per_thread * wid;
+struct DaemonClient {
+    FILE* in;
+    int out;               // descriptor of the responses (-1 for none)
+    bool cancel_on_close;  // cancel the jobs of the client when it disconnects
+    bool numbered;         // jobs are identified by their line number (--batch)
+    pthread_mutex_t lock;  // serializes the responses
+    int references;        // reader and unfinished jobs
+    int failures;
+    bool http;             // responses are HTTP (--tiles)
+    bool keep_alive;       // the HTTP connection stays open after the response
+};
 
-    pthread_t thread[num_threads];
-    CalcBufferData cb_data[num_threads];
-    for (int t = 0; t < num_threads; t++) {
-        cb_data[t] = {t,
-                      buffer,
-                      t * lines_per_thread,
-                      (t == num_threads - 1) ? hei : (t + 1) * lines_per_thread,
-                      wid,
-                      hei,
-                      max_steps + 1,
-                      0,
-                      x - dx,
-                      x + dx,
-                      y - dy,
-                      y + dy};
-        pthread_create(thread + t, NULL, calc_buffer, (void*)(cb_data + t));
+struct Daemon {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    DaemonJob* jobs;  // unfinished jobs in arrival order
+    int job_count;
+    uint64_t job_number;  // number of the next job
+    unsigned int seed;    // of the daemon, from which the default seeds of the jobs are drawn
+    int num_threads;
+    int free_threads;
+};
+
+static Daemon daemon_state = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL,
+                              0, 0, 0, 0, 0};
+
+// Threads of a job: its -p, or one per JOB_PIXELS_PER_THREAD pixels of its -g size (all of
+// them for dumps loaded with -l), up to the threads of the daemon.
+static int job_threads(const DaemonJob* job, int num_threads) {
+    long pixels = 960 * 540;
+    int threads = 0;
+    for (int i = 0; i < job->argc; i++) {
+        if (strcmp(job->argv[i], "-p") == 0 && i + 1 < job->argc) {
+            threads = atoi(job->argv[i + 1]);
+        } else if (strcmp(job->argv[i], "-g") == 0 && i + 2 < job->argc) {
+            pixels = (long)atoi(job->argv[i + 1]) * atoi(job->argv[i + 2]);
+        } else if (strcmp(job->argv[i], "-l") == 0) {
+            pixels = (long)num_threads * JOB_PIXELS_PER_THREAD;
+        }
     }
+    if (threads <= 0) threads = (pixels + JOB_PIXELS_PER_THREAD - 1) / JOB_PIXELS_PER_THREAD;
+    return threads < 1 ? 1 : threads < num_threads ? threads : num_threads;
+}
+
+// Called with daemon_state.lock held.
+static void release_client(DaemonClient* client) {
+    if (--client->references > 0) return;
+    fclose(client->in);
+    pthread_mutex_destroy(&client->lock);
+    free(client);
+}
+
+static bool write_all(int fd, const void* data, size_t size) {
+    const char* p = (const char*)data;
+    while (size > 0) {
+        const ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static void respond_http(DaemonClient* client, int code, const char* reason,
+                         const char* content_type, const void* body, size_t size);
+static void cancel_jobs(DaemonClient* client, const char* id);
+
+static void respond(DaemonJob* job, const char* status) {
+    if (job->client->http) {
+        // Nobody is left to answer for cancelled requests.
+        if (job->output != NULL && strcmp(status, "ok") == 0)
+            respond_http(job->client, 200, "OK", "image/png", job->output, job->output_size);
+        else if (strcmp(status, "error") == 0)
+            respond_http(job->client, 500, "Internal Server Error", "text/plain", "error\n", 6);
+        return;
+    }
+    char line[4096];
+    int n;
+    if (job->output != NULL && strcmp(status, "ok") == 0)
+        n = snprintf(line, sizeof(line), "ok %s %zu\n", job->id, job->output_size);
+    else
+        n = snprintf(line, sizeof(line), "%s %s\n", status, job->id);
+    pthread_mutex_lock(&job->client->lock);
+    bool written = write_all(job->client->out, line, n);
+    if (written && job->output != NULL && strcmp(status, "ok") == 0)
+        written = write_all(job->client->out, job->output, job->output_size);
+    pthread_mutex_unlock(&job->client->lock);
+    // Nobody reads the responses anymore.
+    if (!written && job->client->cancel_on_close) cancel_jobs(job->client, NULL);
+}
+
+static void run_job(DaemonJob* job, int num_threads) {
+    char threads[16];
+    snprintf(threads, sizeof(threads), "%d", num_threads);
+    // Jobs without -r get distinct seeds, reproducible from the -r of the daemon.
+    char seed[16];
+    snprintf(seed, sizeof(seed), "%u", (unsigned int)random_bits(daemon_state.seed, job->number));
+    char* argv[job->argc + 6];
+    // A -p or -r of the job comes after these ones.
+    argv[0] = (char*)"mandelbrot";
+    argv[1] = (char*)"-p";
+    argv[2] = threads;
+    argv[3] = (char*)"-r";
+    argv[4] = seed;
+    for (int i = 0; i < job->argc; i++) argv[5 + i] = job->argv[i];
+    argv[5 + job->argc] = NULL;
 
-    uint32_t smin = max_steps + 1;
-    uint32_t smax = 0;
-    for (int t = 0; t < num_threads; t++) {
-        pthread_join(thread[t], NULL);
 #ifdef DEBUG
-        printf("Joined thread %d.\n", t);
-        fflush(stdout);
+    printf("Running job %s with %d threads.\n", job->id, num_threads);
+    fflush(stdout);
 #endif
-        if (cb_data[t].smin < smin) smin = cb_data[t].smin;
-        if (cb_data[t].smax > smax) smax = cb_data[t].smax;
+
+    // run changes the iteration limits of the thread with -z.
+    const uint32_t saved_max_steps = max_steps;
+    const uint32_t saved_min_steps = min_steps;
+    daemon_job = job;
+    const int result = job->cancelled ? 1 : run(job->argc + 5, argv);
+    daemon_job = NULL;
+    max_steps = saved_max_steps;
+    min_steps = saved_min_steps;
+    fflush(stdout);
+    if (job->cancelled || result != 0) {
+        pthread_mutex_lock(&job->client->lock);
+        job->client->failures++;
+        pthread_mutex_unlock(&job->client->lock);
     }
+    if (job->client->out >= 0)
+        respond(job, job->cancelled ? "cancelled" : result == 0 ? "ok" : "error");
+    else if (result != 0 && !job->cancelled)
+        fprintf(stderr, "Error: job on line %s failed.\n", job->id);
+}
 
-    const long double log_min = log(smin);
-    const long double log_max = log(smax);
-    long double log_delta;
-    if (log_max > log_min) {
-        log_delta = log_max - log_min;
-    } else {
-        log_delta = 1.0;
-        printf("WARNING: Selected window contains no detectable variation.\n");
-        fflush(stdout);
+static void* daemon_runner(void*) {
+    Daemon& daemon = daemon_state;
+    pthread_mutex_lock(&daemon.lock);
+    for (;;) {
+        DaemonJob* job = daemon.jobs;
+        while (job != NULL && job->started) job = job->next;
+        if (job == NULL || job->num_threads > daemon.free_threads) {
+            pthread_cond_wait(&daemon.changed, &daemon.lock);
+            continue;
+        }
+        job->started = true;
+        daemon.free_threads -= job->num_threads;
+        pthread_mutex_unlock(&daemon.lock);
+
+        run_job(job, job->num_threads);
+
+        pthread_mutex_lock(&daemon.lock);
+        daemon.free_threads += job->num_threads;
+        DaemonJob** link = &daemon.jobs;
+        while (*link != job) link = &(*link)->next;
+        *link = job->next;
+        daemon.job_count--;
+        release_client(job->client);
+        free(job->output);
+        free(job->argv);
+        free(job->line);
+        delete job;
+        pthread_cond_broadcast(&daemon.changed);
+    }
+    return NULL;
+}
+
+// Whether the peer of a Unix domain socket closed it, as opposed to only shutting down its
+// sending side (which ends the input but still expects the responses).
+static bool socket_hung_up(int fd) {
+    struct pollfd p = {fd, 0, 0};
+    return poll(&p, 1, 0) > 0 && (p.revents & (POLLHUP | POLLERR));
+}
+
+#define CLIENT_POLL_MS 100
+
+// Wait for the unfinished jobs of client, cancelling them once closed(client->out) tells that
+// it disconnected.
+static void wait_client_jobs(DaemonClient* client, bool (*closed)(int)) {
+    pthread_mutex_lock(&daemon_state.lock);
+    while (client->references > 1) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += CLIENT_POLL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&daemon_state.changed, &daemon_state.lock, &deadline);
+        if (client->references > 1 && closed(client->out))
+            for (DaemonJob* job = daemon_state.jobs; job != NULL; job = job->next)
+                if (job->client == client) job->cancelled = true;
     }
+    pthread_mutex_unlock(&daemon_state.lock);
+}
 
-    GenImageData gi_data[num_threads];
-    for (int t = 0; t < num_threads; t++) {
-        gi_data[t] = {t,
-                      buffer,
-                      t * lines_per_thread,
-                      (t == num_threads - 1) ? hei : (t + 1) * lines_per_thread,
-                      wid,
-                      hei,
-                      log_min,
-                      log_delta,
-                      colormap,
-                      max_index};
-        pthread_create(thread + t, NULL, gen_image, (void*)(gi_data + t));
+// Append job to the jobs waiting for runners.
+static void queue_job(DaemonJob* job) {
+    job->num_threads = job_threads(job, daemon_state.num_threads);
+    pthread_mutex_lock(&daemon_state.lock);
+    DaemonJob** link = &daemon_state.jobs;
+    while (*link != NULL) link = &(*link)->next;
+    *link = job;
+    job->number = daemon_state.job_number++;
+    daemon_state.job_count++;
+    job->client->references++;
+    pthread_cond_signal(&daemon_state.changed);
+    pthread_mutex_unlock(&daemon_state.lock);
+}
+
+// Cancel the unfinished jobs of client with the given id (or all of them if id is NULL).
+static void cancel_jobs(DaemonClient* client, const char* id) {
+    pthread_mutex_lock(&daemon_state.lock);
+    for (DaemonJob* job = daemon_state.jobs; job != NULL; job = job->next)
+        if (job->client == client && (id == NULL || strcmp(job->id, id) == 0))
+            job->cancelled = true;
+    pthread_mutex_unlock(&daemon_state.lock);
+}
+
+static void read_jobs(DaemonClient* client) {
+    char* text = NULL;
+    size_t capacity = 0;
+    for (int number = 1; getline(&text, &capacity, client->in) > 0; number++) {
+        if (text[0] == '#') continue;
+        char* line;
+        if (client->numbered) {
+            line = (char*)malloc(strlen(text) + 16);
+            sprintf(line, "%d %s", number, text);
+        } else {
+            line = strdup(text);
+        }
+        char* save;
+        char* id = strtok_r(line, " \t\r\n", &save);
+        if (id == NULL) {
+            free(line);
+            continue;
+        }
+        if (strcmp(id, "cancel") == 0) {
+            const char* target = strtok_r(NULL, " \t\r\n", &save);
+            if (target != NULL) cancel_jobs(client, target);
+            free(line);
+            continue;
+        }
+
+        DaemonJob* job = new DaemonJob();
+        job->client = client;
+        job->line = line;
+        job->id = id;
+        job->argv = (char**)malloc(sizeof(char*) * strlen(text));
+        for (char* arg = strtok_r(NULL, " \t\r\n", &save); arg != NULL;
+             arg = strtok_r(NULL, " \t\r\n", &save))
+            job->argv[job->argc++] = arg;
+        if (job->argc == 0 && client->numbered) {
+            free(job->argv);
+            free(line);
+            delete job;
+            continue;
+        }
+        queue_job(job);
     }
+    free(text);
+}
+
+static void* daemon_reader(void* p) {
+    DaemonClient* client = (DaemonClient*)p;
+    read_jobs(client);
+    // The end of the input may only be a shutdown of the sending side of the client.
+    wait_client_jobs(client, socket_hung_up);
+    pthread_mutex_lock(&daemon_state.lock);
+    release_client(client);
+    pthread_mutex_unlock(&daemon_state.lock);
+    return NULL;
+}
 
+static void start_runners(int num_threads, unsigned int seed) {
+    daemon_state.seed = seed;
+    daemon_state.num_threads = num_threads;
+    daemon_state.free_threads = num_threads;
     for (int t = 0; t < num_threads; t++) {
-        pthread_join(thread[t], NULL);
-#ifdef DEBUG
-        printf("Joined thread %d.\n", t);
-        fflush(stdout);
-#endif
+        pthread_t thread;
+        pthread_create(&thread, NULL, daemon_runner, NULL);
+        pthread_detach(thread);
     }
+}
 
-#ifdef DEBUG
-    printf("Saving image.\n");
-    fflush(stdout);
-#endif
+// Run all the jobs of client, returning the number of failed ones.
+static int run_client_jobs(DaemonClient* client) {
+    read_jobs(client);
+    pthread_mutex_lock(&daemon_state.lock);
+    while (daemon_state.job_count > 0)
+        pthread_cond_wait(&daemon_state.changed, &daemon_state.lock);
+    pthread_mutex_unlock(&daemon_state.lock);
+    return client->failures;
+}
 
-    stbi_write_png_compression_level = 10;
-    stbi_write_png(filename, wid, hei, 4, buffer, wid * 4);
+static int run_batch(const char* filename, int num_threads, unsigned int seed) {
+    FILE* in = fopen(filename, "r");
+    if (in == NULL) {
+        fprintf(stderr, "Error: unable to open %s for reading.\n", filename);
+        return 1;
+    }
+    start_runners(num_threads, seed);
+    DaemonClient client = {in, -1, false, true, PTHREAD_MUTEX_INITIALIZER, 1, 0, false, false};
+    const int failures = run_client_jobs(&client);
+    fclose(in);
+    return failures > 0 ? 1 : 0;
+}
 
-#ifdef DEBUG
-    printf("Done.\n");
+static int serve(const char* path, int num_threads, unsigned int seed) {
+    signal(SIGPIPE, SIG_IGN);
+    start_runners(num_threads, seed);
+
+    if (strcmp(path, "-") == 0) {
+        // Responses only on the original standard output.
+        DaemonClient client = {stdin, dup(STDOUT_FILENO), false, false, PTHREAD_MUTEX_INITIALIZER,
+                               1,     0,                  false, false};
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+        run_client_jobs(&client);
+        close(client.out);
+        return 0;
+    }
+
+    struct sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Error: socket path %s is too long.\n", path);
+        return 1;
+    }
+    strcpy(address.sun_path, path);
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+        listen(fd, SOMAXCONN) < 0) {
+        fprintf(stderr, "Error: unable to listen on %s.\n", path);
+        return 1;
+    }
+    for (;;) {
+        const int connection = accept(fd, NULL, NULL);
+        if (connection < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error: unable to accept connections on %s.\n", path);
+            return 1;
+        }
+        DaemonClient* client = (DaemonClient*)malloc(sizeof(DaemonClient));
+        *client = {fdopen(connection, "r"), connection, true, false, PTHREAD_MUTEX_INITIALIZER, 1,
+                   0,  false, false};
+        pthread_t thread;
+        pthread_create(&thread, NULL, daemon_reader, client);
+        pthread_detach(thread);
+    }
+}
+
+// Tile server (--tiles PORT): an HTTP/1.1 server on the loopback interface answering
+// GET /Z/X/Y.png with the TILE_SIZE x TILE_SIZE tile X, Y (from the top left) of the square
+// [TILE_XMIN, TILE_XMIN + TILE_WORLD] x [TILE_YMIN, TILE_YMIN + TILE_WORLD] divided in 2^Z x 2^Z
+// tiles.  Each request becomes a daemon job rendering the tile with --pipeline and a fixed
+// normalization (so that neighbor tiles match), and pixel centers are offset by half a pixel
+// from the tile edges so that tiles do not overlap.  The coordinates are printed with the
+// digits needed at the zoom level, up to TILE_MAX_ZOOM where a pixel is 2^16 units in the
+// last place of a long double.  Requests of a connection are answered in order (keep-alive
+// by default for HTTP/1.1), and the job of a request is cancelled if its client disconnects.
+#define TILE_SIZE 256
+#define TILE_XMIN -2.5L
+#define TILE_YMIN -2.0L
+#define TILE_WORLD 4.0L
+#define TILE_MAX_ZOOM (LDBL_MANT_DIG - 16)
+
+static char tile_options[256];  // options of the tile jobs besides their window
+
+static void respond_http(DaemonClient* client, int code, const char* reason,
+                         const char* content_type, const void* body, size_t size) {
+    char header[256];
+    const int n = snprintf(header, sizeof(header),
+                           "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n"
+                           "Connection: %s\r\n\r\n",
+                           code, reason, content_type, size,
+                           client->keep_alive ? "keep-alive" : "close");
+    pthread_mutex_lock(&client->lock);
+    if (write_all(client->out, header, n)) write_all(client->out, body, size);
+    pthread_mutex_unlock(&client->lock);
+}
+
+// Whether the peer of a connection closed it (ignoring the requests not read yet).
+static bool connection_closed(int fd) {
+    struct pollfd p = {fd, POLLIN, 0};
+    if (poll(&p, 1, 0) <= 0) return false;
+    char c;
+    return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0 || (p.revents & (POLLERR | POLLHUP));
+}
+
+// Queue the job rendering tile (x, y) of zoom level z for client.  Returns false if the job
+// line does not fit.
+static bool queue_tile(DaemonClient* client, int z, long x, long y) {
+    const long double size = TILE_WORLD / ldexpl(1, z);
+    const long double half = size / 2 * (TILE_SIZE - 1) / TILE_SIZE;
+    // Enough digits for 1/256 of a pixel.
+    const int digits = (int)ceil((z + log2(TILE_SIZE) + 10) * log10(2.0)) + 1;
+    // The ID is made from the parsed numbers, as the target may be padded with zeros.
+    char* line = (char*)malloc(1024);
+    const int n = snprintf(line, 1024, "%d/%ld/%ld -g %d %d -c %.*Lf %.*Lf -s %.*Lg %.*Lg %s -", z,
+                           x, y, TILE_SIZE, TILE_SIZE, digits, TILE_XMIN + (x + 0.5L) * size,
+                           digits, TILE_YMIN + (y + 0.5L) * size, digits, 2 * half, digits,
+                           2 * half, tile_options);
+    if (n < 0 || n >= 1024) {
+        free(line);
+        return false;
+    }
+
+    DaemonJob* job = new DaemonJob();
+    job->client = client;
+    job->line = line;
+    job->argv = (char**)malloc(sizeof(char*) * strlen(line));
+    char* save;
+    job->id = strtok_r(line, " ", &save);
+    for (char* arg = strtok_r(NULL, " ", &save); arg != NULL; arg = strtok_r(NULL, " ", &save))
+        job->argv[job->argc++] = arg;
+    queue_job(job);
+    return true;
+}
+
+static void read_http_requests(DaemonClient* client) {
+    char* text = NULL;
+    size_t capacity = 0;
+    while (getline(&text, &capacity, client->in) > 0) {
+        char method[16], target[1024], version[16];
+        if (strspn(text, "\r\n") == strlen(text)) continue;
+        const bool valid = sscanf(text, "%15s %1023s %15s", method, target, version) == 3;
+        client->keep_alive = valid && strcmp(version, "HTTP/1.1") == 0;
+        while (getline(&text, &capacity, client->in) > 0 && strspn(text, "\r\n") != strlen(text)) {
+            if (strncasecmp(text, "Connection:", 11) != 0) continue;
+            if (strcasestr(text, "close") != NULL) client->keep_alive = false;
+            if (strcasestr(text, "keep-alive") != NULL) client->keep_alive = true;
+        }
+        if (!valid) {
+            client->keep_alive = false;
+            respond_http(client, 400, "Bad Request", "text/plain", "bad request\n", 12);
+            break;
+        }
+
+        int z, length = 0;
+        long x, y;
+        if (strcmp(method, "GET") != 0) {
+            respond_http(client, 405, "Method Not Allowed", "text/plain", "GET only\n", 9);
+        } else if (sscanf(target, "/%d/%ld/%ld.png%n", &z, &x, &y, &length) != 3 ||
+                   target[length] != '\0' || z < 0 || z > TILE_MAX_ZOOM || x < 0 || y < 0 ||
+                   x >= (1L << z) || y >= (1L << z)) {
+            respond_http(client, 404, "Not Found", "text/plain", "no such tile\n", 13);
+        } else if (queue_tile(client, z, x, y)) {
+            wait_client_jobs(client, connection_closed);
+        } else {
+            respond_http(client, 500, "Internal Server Error", "text/plain", "error\n", 6);
+        }
+        if (!client->keep_alive) break;
+    }
+    free(text);
+}
+
+static void* http_reader(void* p) {
+    DaemonClient* client = (DaemonClient*)p;
+    read_http_requests(client);
+    pthread_mutex_lock(&daemon_state.lock);
+    release_client(client);
+    pthread_mutex_unlock(&daemon_state.lock);
+    return NULL;
+}
+
+static int serve_tiles(int port, const char* options, int num_threads, unsigned int seed) {
+    signal(SIGPIPE, SIG_IGN);
+    snprintf(tile_options, sizeof(tile_options), "%s", options);
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    const int reuse = 1;
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0 ||
+        bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+        listen(fd, SOMAXCONN) < 0) {
+        fprintf(stderr, "Error: unable to listen on port %d.\n", port);
+        return 1;
+    }
+    printf("Serving tiles on http://127.0.0.1:%d/Z/X/Y.png (%s).\n", port, tile_options);
     fflush(stdout);
-#endif
+    start_runners(num_threads, seed);
+    for (;;) {
+        const int connection = accept(fd, NULL, NULL);
+        if (connection < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error: unable to accept connections on port %d.\n", port);
+            return 1;
+        }
+        DaemonClient* client = (DaemonClient*)malloc(sizeof(DaemonClient));
+        *client = {fdopen(connection, "r"), connection, true, false, PTHREAD_MUTEX_INITIALIZER, 1,
+                   0,  true, true};
+        pthread_t thread;
+        pthread_create(&thread, NULL, http_reader, client);
+        pthread_detach(thread);
+    }
+}
 
-    free(buffer);
+// Load test of a tile server (--load-test PORT CONNECTIONS REQUESTS): each connection sends
+// REQUESTS keep-alive requests for random tiles, one at a time, with zoom levels up to
+// LOAD_TEST_MAX_ZOOM.  The throughput and latency percentiles are reported.
+#define LOAD_TEST_MAX_ZOOM 16
 
-    return 0;
+struct LoadTestData {
+    int port;
+    int requests;
+    Random rng;
+    double* latencies;  // of the successful requests, in ms
+    int succeeded, failed;
+    size_t bytes;
+};
+
+// Read one HTTP response from in, returning its status code (0 on errors).
+static int read_http_response(FILE* in, size_t& bytes) {
+    char line[1024];
+    int code = 0;
+    size_t length = 0;
+    if (fgets(line, sizeof(line), in) == NULL || sscanf(line, "HTTP/%*s %d", &code) != 1)
+        return 0;
+    while (fgets(line, sizeof(line), in) != NULL && strspn(line, "\r\n") != strlen(line))
+        if (strncasecmp(line, "Content-Length:", 15) == 0) length = strtoul(line + 15, NULL, 10);
+    char buffer[4096];
+    for (size_t left = length; left > 0;) {
+        const size_t n = fread(buffer, 1, left < sizeof(buffer) ? left : sizeof(buffer), in);
+        if (n == 0) return 0;
+        left -= n;
+    }
+    bytes += length;
+    return code;
+}
+
+static void* load_test_connection(void* p) {
+    LoadTestData* data = (LoadTestData*)p;
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(data->port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        if (fd >= 0) close(fd);
+        fprintf(stderr, "Error: unable to connect to port %d.\n", data->port);
+        data->failed = data->requests;
+        return NULL;
+    }
+    FILE* in = fdopen(fd, "r");
+    for (int k = 0; k < data->requests; k++) {
+        const int z = random_next(data->rng) % (LOAD_TEST_MAX_ZOOM + 1);
+        const long x = random_next(data->rng) % (1L << z);
+        const long y = random_next(data->rng) % (1L << z);
+        char request[256];
+        const int n = snprintf(request, sizeof(request),
+                               "GET /%d/%ld/%ld.png HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n", z, x,
+                               y);
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (!write_all(fd, request, n) || read_http_response(in, data->bytes) != 200) {
+            data->failed += data->requests - k;
+            break;
+        }
+        data->latencies[data->succeeded++] = elapsed_ms(start);
+    }
+    fclose(in);
+    return NULL;
+}
+
+static int load_test(int port, int connections, int requests, unsigned int seed) {
+    signal(SIGPIPE, SIG_IGN);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    double* latencies = (double*)malloc(sizeof(double) * connections * requests);
+    pthread_t thread[connections];
+    LoadTestData lt_data[connections];
+    for (int c = 0; c < connections; c++) {
+        lt_data[c] = {port, requests, {random_bits(seed, c), 0}, latencies + (size_t)c * requests,
+                      0,    0,        0};
+        pthread_create(thread + c, NULL, load_test_connection, (void*)(lt_data + c));
+    }
+    int succeeded = 0;
+    int failed = 0;
+    size_t bytes = 0;
+    for (int c = 0; c < connections; c++) {
+        pthread_join(thread[c], NULL);
+        memmove(latencies + succeeded, lt_data[c].latencies,
+                sizeof(double) * lt_data[c].succeeded);
+        succeeded += lt_data[c].succeeded;
+        failed += lt_data[c].failed;
+        bytes += lt_data[c].bytes;
+    }
+    const double elapsed = elapsed_ms(start);
+    std::sort(latencies, latencies + succeeded);
+    auto percentile = [&](double q) {
+        return succeeded > 0 ? latencies[std::min(succeeded - 1, (int)(q * succeeded))] : 0.0;
+    };
+    printf("Load test: %d requests (%d failed, %zu bytes) in %g ms, %g requests/s.\n",
+           succeeded + failed, failed, bytes, elapsed, succeeded * 1e3 / elapsed);
+    printf("Latency: p50 %g ms, p90 %g ms, p99 %g ms, max %g ms.\n", percentile(0.5),
+           percentile(0.9), percentile(0.99), percentile(1));
+    free(latencies);
+    return failed > 0 ? 1 : 0;
+}
+
+int main(int argc, char* argv[]) {
+    // Set once for all the jobs of a daemon.
+    stbi_write_png_compression_level = 10;
+    return run(argc, argv);
 }